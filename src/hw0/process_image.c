@@ -28,6 +28,24 @@ image copy_image(image im)
     return copy;
 }
 
+// Copy a rectangle out of an image, clipped to the image.
+// image im: source image.
+// int x, y: top left corner of the rectangle.
+// int w, h: size of the rectangle.
+// returns: the cropped image.
+image crop_image(image im, int x, int y, int w, int h)
+{
+    int x0 = MAX(x, 0), y0 = MAX(y, 0);
+    int x1 = MIN(x + w, im.w), y1 = MIN(y + h, im.h);
+    image c = make_image(MAX(x1 - x0, 0), MAX(y1 - y0, 0), im.c);
+    for (int k = 0; k < im.c; k++) {
+        for (int j = 0; j < c.h; j++) {
+            memcpy(c.data + k*c.w*c.h + j*c.w, im.data + k*im.w*im.h + (y0 + j)*im.w + x0, c.w*sizeof(float));
+        }
+    }
+    return c;
+}
+
 image rgb_to_grayscale(image im)
 {
     assert(im.c == 3);
@@ -1,4 +1,5 @@
 #include <math.h>
+#include <stdlib.h>
 #include "image.h"
 
 float nn_interpolate(image im, float x, float y, int c)
@@ -40,3 +41,118 @@ image bilinear_resize(image im, int w, int h)
     }
     return resize;
 }
+
+// Source taps and weights for resampling one axis of an image.
+// int src, dst: source and destination length along the axis.
+// int *lo, *hi: clamped source indices on either side of each sample.
+// float *f: weight of the hi tap, lo gets 1-f.
+typedef struct{
+    int src, dst;
+    int *lo, *hi;
+    float *f;
+} resize_axis;
+
+// Fill in a resize_axis, reusing its buffers when the sizes match.
+// resize_axis *a: axis table to fill.
+// int src, dst: source and destination length.
+void make_resize_axis(resize_axis *a, int src, int dst)
+{
+    if (a->src == src && a->dst == dst && a->lo) return;
+    if (a->dst != dst || !a->lo) {
+        free(a->lo); free(a->hi); free(a->f);
+        a->lo = calloc(dst, sizeof(int));
+        a->hi = calloc(dst, sizeof(int));
+        a->f = calloc(dst, sizeof(float));
+    }
+    a->src = src;
+    a->dst = dst;
+    for (int i = 0; i < dst; i++) {
+        float x = (i+0.5) * src / dst - 0.5;
+        int x0 = floor(x);
+        a->f[i] = x - x0;
+        a->lo[i] = MIN(MAX(x0, 0), src - 1);
+        a->hi[i] = MIN(MAX(x0 + 1, 0), src - 1);
+    }
+}
+
+void free_resize_axis(resize_axis a)
+{
+    free(a.lo);
+    free(a.hi);
+    free(a.f);
+}
+
+// Bilinear resize into a preallocated buffer using precomputed axis tables.
+// image im: source image.
+// resize_axis ax, ay: tables for the x and y axis.
+// float *out: destination, ax.dst x ay.dst x c floats.
+// int c: number of channels to write, missing source channels repeat the last.
+void bilinear_resize_into(image im, resize_axis ax, resize_axis ay, float *out, int c)
+{
+    int w = ax.dst, h = ay.dst;
+    for (int k = 0; k < c; k++) {
+        float *src = im.data + MIN(k, im.c - 1) * im.w * im.h;
+        float *dst = out + k * w * h;
+        for (int j = 0; j < h; j++) {
+            float *r0 = src + ay.lo[j] * im.w;
+            float *r1 = src + ay.hi[j] * im.w;
+            float fy = ay.f[j];
+            for (int i = 0; i < w; i++) {
+                float fx = ax.f[i];
+                float top = r0[ax.lo[i]] * (1 - fx) + r0[ax.hi[i]] * fx;
+                float bot = r1[ax.lo[i]] * (1 - fx) + r1[ax.hi[i]] * fx;
+                dst[j * w + i] = top * (1 - fy) + bot * fy;
+            }
+        }
+    }
+}
+
+// Bilinear resize a batch of images into one contiguous tensor.
+// image *ims: images to resize, all should have the same number of channels.
+// int n: number of images.
+// int w, h: target size.
+// returns: w x h x (n*c) image, image i occupies channels [i*c, (i+1)*c),
+//          i.e. an NCHW tensor.
+image bilinear_resize_batch(image *ims, int n, int w, int h)
+{
+    int c = n ? ims[0].c : 0;
+    image out = make_image(w, h, n*c);
+    #pragma omp parallel
+    {
+        resize_axis ax = {0}, ay = {0};
+        #pragma omp for schedule(dynamic)
+        for (int i = 0; i < n; i++) {
+            make_resize_axis(&ax, ims[i].w, w);
+            make_resize_axis(&ay, ims[i].h, h);
+            bilinear_resize_into(ims[i], ax, ay, out.data + (size_t)i*w*h*c, c);
+        }
+        free_resize_axis(ax);
+        free_resize_axis(ay);
+    }
+    return out;
+}
+
+// Load a list of images and bilinear resize them into one contiguous tensor.
+// char **paths: image files to load.
+// int n: number of files.
+// int w, h, c: target size and number of channels.
+// returns: w x h x (n*c) image, image i occupies channels [i*c, (i+1)*c).
+image load_resize_batch(char **paths, int n, int w, int h, int c)
+{
+    image out = make_image(w, h, n*c);
+    #pragma omp parallel
+    {
+        resize_axis ax = {0}, ay = {0};
+        #pragma omp for schedule(dynamic)
+        for (int i = 0; i < n; i++) {
+            image im = load_image_stb(paths[i], c);
+            make_resize_axis(&ax, im.w, w);
+            make_resize_axis(&ay, im.h, h);
+            bilinear_resize_into(im, ax, ay, out.data + (size_t)i*w*h*c, c);
+            free_image(im);
+        }
+        free_resize_axis(ax);
+        free_resize_axis(ay);
+    }
+    return out;
+}
@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <float.h>
+#include "image.h"
+#include "matrix.h"
+
+// Size of the part of the overlap each tile writes.
+#define BLEND_TILE 128
+
+// Blur with the 5 tap binomial kernel and keep every other pixel.
+// image im: image to reduce.
+// returns: (w+1)/2 x (h+1)/2 image.
+image pyramid_down(image im)
+{
+    static const float k[5] = {1/16., 4/16., 6/16., 4/16., 1/16.};
+    image tmp = make_image((im.w + 1)/2, im.h, im.c);
+    image out = make_image((im.w + 1)/2, (im.h + 1)/2, im.c);
+    for (int c = 0; c < im.c; c++) {
+        for (int y = 0; y < im.h; y++) {
+            const float *row = im.data + (c*im.h + y)*im.w;
+            for (int x = 0; x < tmp.w; x++) {
+                float sum = 0;
+                for (int t = -2; t <= 2; t++) sum += k[t + 2]*row[MIN(MAX(2*x + t, 0), im.w - 1)];
+                tmp.data[(c*tmp.h + y)*tmp.w + x] = sum;
+            }
+        }
+        for (int y = 0; y < out.h; y++) {
+            for (int x = 0; x < out.w; x++) {
+                float sum = 0;
+                for (int t = -2; t <= 2; t++) sum += k[t + 2]*tmp.data[(c*tmp.h + MIN(MAX(2*y + t, 0), im.h - 1))*tmp.w + x];
+                out.data[(c*out.h + y)*out.w + x] = sum;
+            }
+        }
+    }
+    free_image(tmp);
+    return out;
+}
+
+// Expand a pyramid level back up by bilinear interpolation.
+// image im: coarse level.
+// int w, h: size of the finer level.
+// returns: w x h image.
+static image pyr_up(image im, int w, int h)
+{
+    image out = make_image(w, h, im.c);
+    float *v = calloc(im.c, sizeof(float));
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            bilinear_sample(im, MIN(x*.5f, im.w - 1), MIN(y*.5f, im.h - 1), v);
+            for (int c = 0; c < im.c; c++) out.data[(c*h + y)*w + x] = v[c];
+        }
+    }
+    free(v);
+    return out;
+}
+
+// Blend two images with a Laplacian pyramid, after Burt and Adelson,
+// "A Multiresolution Spline With Application to Image Mosaics".
+// image a, b: images to blend, same size.
+// image m: weight of b, 1 channel, same size.
+// int bands: number of pyramid levels.
+// returns: blended image.
+static image multiband(image a, image b, image m, int bands)
+{
+    if (bands <= 0 || a.w < 2 || a.h < 2) {
+        image out = make_image(a.w, a.h, a.c);
+        for (int c = 0; c < a.c; c++) {
+            for (int i = 0; i < a.w*a.h; i++) {
+                float *o = out.data + c*a.w*a.h;
+                o[i] = a.data[c*a.w*a.h + i] + m.data[i]*(b.data[c*a.w*a.h + i] - a.data[c*a.w*a.h + i]);
+            }
+        }
+        return out;
+    }
+    image ga = pyramid_down(a), gb = pyramid_down(b), gm = pyramid_down(m);
+    image coarse = multiband(ga, gb, gm, bands - 1);
+    image ua = pyr_up(ga, a.w, a.h), ub = pyr_up(gb, b.w, b.h);
+    image out = pyr_up(coarse, a.w, a.h);
+    // Add back this level's blended detail, L = G - up(G').
+    for (int c = 0; c < a.c; c++) {
+        for (int i = 0; i < a.w*a.h; i++) {
+            int j = c*a.w*a.h + i;
+            float la = a.data[j] - ua.data[j];
+            float lb = b.data[j] - ub.data[j];
+            out.data[j] += la + m.data[i]*(lb - la);
+        }
+    }
+    free_image(ga); free_image(gb); free_image(gm);
+    free_image(ua); free_image(ub);
+    free_image(coarse);
+    return out;
+}
+
+// Distance to the nearest edge of a w x h image, 0 outside it.
+static float edge_weight(float x, float y, int w, int h)
+{
+    float d = MIN(MIN(x + 1, w - x), MIN(y + 1, h - y));
+    return d > 0 ? d : 0;
+}
+
+// Blend b into the overlap of a composite, tile by tile. Tiles only cover
+// the part of a's rectangle that b's footprint can reach and each one
+// allocates its own small buffers, so memory follows the overlap size.
+// Tiles read a halo around what they write, reaching past a's edge into
+// b's side so the coarse bands see b there too.
+// image c: composite from combine_images, b drawn over a.
+// image a, b: source images.
+// homography H: a coordinates to b coordinates.
+// int dx, dy: a's pixel (0,0) is at (-dx,-dy) in c.
+// int x0, y0, x1, y1: overlap in a coordinates, x1 and y1 exclusive.
+// int bands: pyramid levels, 0 for feathering.
+static void blend_overlap(image c, image a, image b, homography H, int dx, int dy,
+                          int x0, int y0, int x1, int y1, int bands)
+{
+    int halo = bands ? 4 << bands : 0;
+    int tw = (x1 - x0 + BLEND_TILE - 1)/BLEND_TILE;
+    int th = (y1 - y0 + BLEND_TILE - 1)/BLEND_TILE;
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int t = 0; t < tw*th; t++) {
+        // Interior the tile writes, and the extent it reads around it.
+        int ix0 = x0 + (t%tw)*BLEND_TILE, iy0 = y0 + (t/tw)*BLEND_TILE;
+        int ix1 = MIN(ix0 + BLEND_TILE, x1), iy1 = MIN(iy0 + BLEND_TILE, y1);
+        int ex0 = MAX(ix0 - halo, dx), ey0 = MAX(iy0 - halo, dy);
+        int ex1 = MIN(ix1 + halo, c.w + dx), ey1 = MIN(iy1 + halo, c.h + dy);
+        int w = ex1 - ex0, h = ey1 - ey0;
+
+        image ta = make_image(w, h, a.c);
+        image tb = make_image(w, h, a.c);
+        image wa = make_image(w, h, 1);
+        image wb = make_image(w, h, 1);
+        float *v = calloc(b.c, sizeof(float));
+        int any = 0;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                int i = y*w + x;
+                int ax = MIN(MAX(ex0 + x, 0), a.w - 1);
+                int ay = MIN(MAX(ey0 + y, 0), a.h - 1);
+                // Past a's edge use b, or a's nearest pixel if b is not there.
+                for (int k = 0; k < a.c; k++) {
+                    ta.data[k*w*h + i] = a.data[(k*a.h + ay)*a.w + ax];
+                }
+                wa.data[i] = edge_weight(ex0 + x, ey0 + y, a.w, a.h);
+                point p = project_point_h(H, make_point(ex0 + x, ey0 + y));
+                if (p.x >= 0 && p.y >= 0 && p.x < b.w && p.y < b.h) {
+                    bilinear_sample(b, p.x, p.y, v);
+                    for (int k = 0; k < a.c; k++) tb.data[k*w*h + i] = v[MIN(k, b.c - 1)];
+                    wb.data[i] = edge_weight(p.x, p.y, b.w, b.h);
+                    if (wa.data[i] == 0) {
+                        for (int k = 0; k < a.c; k++) ta.data[k*w*h + i] = tb.data[k*w*h + i];
+                    }
+                    any = 1;
+                } else {
+                    // Outside b, blend a with itself so nothing bleeds in.
+                    for (int k = 0; k < a.c; k++) tb.data[k*w*h + i] = ta.data[k*w*h + i];
+                }
+            }
+        }
+
+        if (any) {
+            // Weight of b: feathered by distance to each image's edge, or a
+            // hard seam where b's edge gets closer than a's for multi-band.
+            for (int i = 0; i < w*h; i++) {
+                float s = wa.data[i] + wb.data[i];
+                if (bands) wb.data[i] = wb.data[i] > wa.data[i];
+                else wb.data[i] = s > 0 ? wb.data[i]/s : 0;
+            }
+            image out = multiband(ta, tb, wb, bands);
+            for (int k = 0; k < MIN(a.c, c.c); k++) {
+                for (int y = iy0; y < iy1; y++) {
+                    memcpy(c.data + (k*c.h + y - dy)*c.w + ix0 - dx,
+                           out.data + (k*h + y - ey0)*w + ix0 - ex0, (ix1 - ix0)*sizeof(float));
+                }
+            }
+            free_image(out);
+        }
+        free(v);
+        free_image(ta); free_image(tb);
+        free_image(wa); free_image(wb);
+    }
+}
+
+// Stitch two images like combine_images, but blend the overlap instead
+// of drawing b over a.
+// image a, b: images to stitch.
+// matrix H: homography from image a coordinates to image b coordinates.
+// int bands: pyramid levels for multi-band blending, 0 to feather by
+//            distance to each image's edge instead. Typical: 4-6
+// returns: combined image stitched together.
+image combine_images_blend(image a, image b, matrix H, int bands)
+{
+    int ok = 0;
+    homography Hh = matrix_to_homography(H);
+    homography Hinv = homography_invert(Hh, &ok);
+    if (!ok) return copy_image(a);
+    image c = combine_images(a, b, H);
+
+    // Same bounds as combine_images.
+    point corners[4] = {make_point(0, 0), make_point(b.w-1, 0),
+                        make_point(0, b.h-1), make_point(b.w-1, b.h-1)};
+    float minx = FLT_MAX, miny = FLT_MAX, maxx = -FLT_MAX, maxy = -FLT_MAX;
+    for (int i = 0; i < 4; i++) {
+        point p = project_point_h(Hinv, corners[i]);
+        minx = MIN(minx, p.x); miny = MIN(miny, p.y);
+        maxx = MAX(maxx, p.x); maxy = MAX(maxy, p.y);
+    }
+    int dx = MIN(0, minx);
+    int dy = MIN(0, miny);
+    int w = MAX(a.w, floorf(maxx) + 1) - dx;
+    int h = MAX(a.h, floorf(maxy) + 1) - dy;
+    // combine_images gave up and returned a.
+    if (c.w != w || c.h != h) return c;
+
+    int x0 = MAX(0, (int)floorf(minx)), y0 = MAX(0, (int)floorf(miny));
+    int x1 = MIN(a.w, (int)ceilf(maxx) + 1), y1 = MIN(a.h, (int)ceilf(maxy) + 1);
+    if (x0 < x1 && y0 < y1) blend_overlap(c, a, b, Hh, dx, dy, x0, y0, x1, y1, bands);
+    return c;
+}
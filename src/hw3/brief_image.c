@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "matrix.h"
+
+#define BRIEF_PATCH 31
+
+// Sampling pattern: BRIEF_BITS pairs of (x1, y1, x2, y2) offsets.
+static int brief_pattern[BRIEF_BITS][4];
+static int brief_ready = 0;
+
+// Draws a standard normal sample from a private LCG so the pattern is
+// fixed and building it doesn't disturb rand().
+// unsigned *state: generator state.
+static float brief_normal(unsigned *state)
+{
+    float u1, u2;
+    do {
+        *state = *state * 1664525u + 1013904223u;
+        u1 = (*state >> 8) / 16777216.f;
+    } while (u1 == 0);
+    *state = *state * 1664525u + 1013904223u;
+    u2 = (*state >> 8) / 16777216.f;
+    return sqrtf(-2*logf(u1)) * cosf(TWOPI*u2);
+}
+
+// Build the fixed sampling pattern, isotropic Gaussian with std. dev
+// BRIEF_PATCH/5 clipped to the patch, as in the BRIEF paper. Safe to call
+// from several threads at once, the first one builds it.
+void make_brief_pattern()
+{
+    #pragma omp critical(brief_pattern)
+    {
+        if (!brief_ready) {
+            unsigned state = 12345;
+            int r = BRIEF_PATCH/2;
+            for (int i = 0; i < BRIEF_BITS; i++) {
+                for (int k = 0; k < 4; k++) {
+                    int v = roundf(brief_normal(&state) * BRIEF_PATCH/5.);
+                    brief_pattern[i][k] = MIN(MAX(v, -r), r);
+                }
+            }
+            brief_ready = 1;
+        }
+    }
+}
+
+// Create a binary descriptor for an index in an image.
+// image im: pre-smoothed image, only channel 0 is used.
+// int i: index in image for the pixel we want to describe.
+// returns: binary descriptor for that index.
+binary_descriptor describe_binary_index(image im, int i)
+{
+    binary_descriptor d;
+    int x = i%im.w;
+    int y = i/im.w;
+    d.p.x = x;
+    d.p.y = y;
+    memset(d.bits, 0, sizeof(d.bits));
+    for (int b = 0; b < BRIEF_BITS; b++) {
+        int *s = brief_pattern[b];
+        float v1 = get_pixel(im, x + s[0], y + s[1], 0);
+        float v2 = get_pixel(im, x + s[2], y + s[3], 0);
+        if (v1 < v2) d.bits[b/64] |= 1ULL << (b%64);
+    }
+    return d;
+}
+
+// Describe points in an image with binary descriptors.
+// image im: input image, grayscale or RGB.
+// peak *p: points to describe.
+// int n: number of points.
+// returns: array of n binary descriptors.
+binary_descriptor *describe_binary_peaks(image im, peak *p, int n)
+{
+    make_brief_pattern();
+    image gray = im.c == 3 ? rgb_to_grayscale(im) : copy_image(im);
+    image smooth = smooth_image(gray, 2);
+    binary_descriptor *d = calloc(n + 1, sizeof(binary_descriptor));
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        d[i] = describe_binary_index(smooth, (int)p[i].p.y * im.w + (int)p[i].p.x);
+    }
+    free_image(gray);
+    free_image(smooth);
+    return d;
+}
+
+// Perform harris corner detection and describe the corners with binary
+// descriptors.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int *n: pointer to number of corners detected, filled in.
+// returns: array of binary descriptors of the corners in the image.
+binary_descriptor *harris_corner_detector_binary(image im, float sigma, float thresh, int nms, int *n)
+{
+    image S = structure_matrix(im, sigma);
+    image R = cornerness_response(S);
+    peak *p = nms_peaks(R, nms, thresh, n);
+    binary_descriptor *d = describe_binary_peaks(im, p, *n);
+    free_image(S);
+    free_image(R);
+    free(p);
+    return d;
+}
+
+// Calculates Hamming distance between two binary descriptors.
+// binary_descriptor *a, *b: descriptors to compare.
+// returns: number of bits that differ.
+int hamming_distance(const binary_descriptor *a, const binary_descriptor *b)
+{
+    return __builtin_popcountll(a->bits[0] ^ b->bits[0]) +
+           __builtin_popcountll(a->bits[1] ^ b->bits[1]) +
+           __builtin_popcountll(a->bits[2] ^ b->bits[2]) +
+           __builtin_popcountll(a->bits[3] ^ b->bits[3]);
+}
+
+// Descriptors compared against one query at a time by the block kernels.
+#define HAMMING_LANES 4
+#define BRIEF_WORDS (BRIEF_BITS/64)
+
+// Hamming distances from a query to a block of HAMMING_LANES descriptors
+// stored word-major, word k of lane l at blk[k*HAMMING_LANES + l], so each
+// query word is xored against adjacent loads and the lanes accumulate
+// independently.
+// const unsigned long long *q: query bits.
+// const unsigned long long *blk: transposed block.
+// int *d: filled with HAMMING_LANES distances.
+static inline __attribute__((always_inline))
+void hamming_block_body(const unsigned long long *q, const unsigned long long *blk, int *d)
+{
+    for (int l = 0; l < HAMMING_LANES; l++) d[l] = 0;
+    for (int k = 0; k < BRIEF_WORDS; k++) {
+        for (int l = 0; l < HAMMING_LANES; l++) {
+            d[l] += __builtin_popcountll(q[k] ^ blk[k*HAMMING_LANES + l]);
+        }
+    }
+}
+
+static void hamming_block(const unsigned long long *q, const unsigned long long *blk, int *d)
+{
+    hamming_block_body(q, blk, d);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Same kernel built with the popcnt instruction, the default target has
+// only a software bit count. Used when the CPU reports popcnt.
+__attribute__((target("popcnt")))
+static void hamming_block_popcnt(const unsigned long long *q, const unsigned long long *blk, int *d)
+{
+    hamming_block_body(q, blk, d);
+}
+#endif
+
+// Finds best matches between binary descriptors of two images. b is
+// transposed into blocks once, then every query scans the blocks with the
+// fastest kernel the CPU supports.
+// binary_descriptor *a, *b: descriptors for pixels in two images.
+// int an, bn: number of descriptors in arrays a and b.
+// int *mn: pointer to number of matches found, filled in.
+// returns: best matches found, one-to-one, sorted by Hamming distance.
+match *match_binary_descriptors(binary_descriptor *a, int an, binary_descriptor *b, int bn, int *mn)
+{
+    void (*kernel)(const unsigned long long *, const unsigned long long *, int *) = hamming_block;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("popcnt")) kernel = hamming_block_popcnt;
+#endif
+    int blocks = (bn + HAMMING_LANES - 1)/HAMMING_LANES;
+    unsigned long long *tb = calloc((size_t)blocks*BRIEF_WORDS*HAMMING_LANES + 1, sizeof(unsigned long long));
+    for (int i = 0; i < bn; i++) {
+        unsigned long long *blk = tb + (size_t)(i/HAMMING_LANES)*BRIEF_WORDS*HAMMING_LANES;
+        for (int k = 0; k < BRIEF_WORDS; k++) blk[k*HAMMING_LANES + i%HAMMING_LANES] = b[i].bits[k];
+    }
+
+    match *m = calloc(an + 1, sizeof(match));
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int j = 0; j < an; j++) {
+        int best = BRIEF_BITS + 1;
+        int bind = 0;
+        int d[HAMMING_LANES];
+        for (int t = 0; t < blocks; t++) {
+            kernel(a[j].bits, tb + (size_t)t*BRIEF_WORDS*HAMMING_LANES, d);
+            int lanes = MIN(HAMMING_LANES, bn - t*HAMMING_LANES);
+            for (int l = 0; l < lanes; l++) {
+                if (d[l] < best) {
+                    best = d[l];
+                    bind = t*HAMMING_LANES + l;
+                }
+            }
+        }
+        m[j].ai = j;
+        m[j].bi = bind;
+        m[j].p = a[j].p;
+        m[j].q = bn ? b[bind].p : a[j].p;
+        m[j].distance = best;
+    }
+    free(tb);
+    *mn = bn ? unique_matches(m, an, bn) : 0;
+    return m;
+}
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "matrix.h"
+
+#define FEATURE_CACHE_MAGIC 0x43465755u // "UWFC"
+#define FEATURE_CACHE_VERSION 1
+
+// Header of a feature cache file. It is followed by n (x, y) float pairs
+// and then n*dim descriptor floats, so the whole file can be mapped and
+// read in place.
+typedef struct{
+    unsigned magic, version;
+    unsigned long long key;
+    float sigma, thresh;
+    int nms, w, h, c;
+    int n, dim;
+} feature_cache_header;
+
+static char feature_cache_dir[1024] = "";
+static int feature_cache_writes = 0;
+
+// Turn the feature cache on or off.
+// const char *dir: directory to keep cache files in, must exist. NULL or
+//                  "" turns the cache off.
+void set_feature_cache(const char *dir)
+{
+    snprintf(feature_cache_dir, sizeof(feature_cache_dir), "%s", dir ? dir : "");
+}
+
+// Fast 64 bit hash of an image's size and pixel values.
+// image im: image to hash.
+// returns: hash, equal images hash equal.
+unsigned long long image_hash(image im)
+{
+    unsigned long long h = 0x9E3779B97F4A7C15ULL ^ ((unsigned long long)im.w << 40 ^ (unsigned long long)im.h << 20 ^ im.c);
+    const unsigned *p = (const unsigned *)im.data;
+    size_t n = (size_t)im.w*im.h*im.c;
+    // Four independent lanes so the multiplies overlap.
+    unsigned long long l[4] = {h, h ^ 1, h ^ 2, h ^ 3};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int k = 0; k < 4; k++) {
+            l[k] = (l[k] ^ p[i + k]) * 0x9E3779B97F4A7C15ULL;
+            l[k] ^= l[k] >> 29;
+        }
+    }
+    for (; i < n; i++) {
+        l[0] = (l[0] ^ p[i]) * 0x9E3779B97F4A7C15ULL;
+        l[0] ^= l[0] >> 29;
+    }
+    for (int k = 0; k < 4; k++) {
+        h ^= l[k] + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    }
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Key for an image and detector parameters.
+static unsigned long long feature_key(image im, float sigma, float thresh, int nms)
+{
+    unsigned long long h = image_hash(im);
+    unsigned s, t;
+    memcpy(&s, &sigma, sizeof(s));
+    memcpy(&t, &thresh, sizeof(t));
+    h ^= ((unsigned long long)s << 32 | t) * 0x9E3779B97F4A7C15ULL;
+    h ^= (unsigned long long)(nms + 1) * 0xC2B2AE3D27D4EB4FULL;
+    return h;
+}
+
+// Load descriptors from a cache file.
+// const char *path: cache file.
+// const feature_cache_header *want: header fields the file must match.
+// int *n: filled with the number of descriptors.
+// returns: descriptors, NULL on a miss or a stale file.
+static descriptor *load_feature_cache(const char *path, const feature_cache_header *want, int *n)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(feature_cache_header)) {
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    descriptor *d = 0;
+    const feature_cache_header *hd = map;
+    size_t size = sizeof(*hd) + ((size_t)2*hd->n + (size_t)hd->n*hd->dim)*sizeof(float);
+    if (hd->magic == want->magic && hd->version == want->version && hd->key == want->key &&
+        hd->sigma == want->sigma && hd->thresh == want->thresh && hd->nms == want->nms &&
+        hd->w == want->w && hd->h == want->h && hd->c == want->c &&
+        hd->n >= 0 && hd->dim >= 0 && (size_t)st.st_size == size) {
+        const float *xy = (const float *)(hd + 1);
+        const float *data = xy + 2*(size_t)hd->n;
+        d = calloc(hd->n + 1, sizeof(descriptor));
+        for (int i = 0; i < hd->n; i++) {
+            d[i].p.x = xy[2*i];
+            d[i].p.y = xy[2*i + 1];
+            d[i].n = hd->dim;
+            d[i].data = malloc(hd->dim*sizeof(float));
+            memcpy(d[i].data, data + (size_t)i*hd->dim, hd->dim*sizeof(float));
+        }
+        *n = hd->n;
+    }
+    munmap(map, st.st_size);
+    return d;
+}
+
+// Write descriptors to a cache file, through a temporary file so readers
+// never see a partial one. Temporary names are unique per call, so threads
+// saving the same image do not write into each other's file.
+// const char *path: cache file.
+// feature_cache_header hd: header, n and dim are filled in here.
+// descriptor *d: descriptors, all the same length.
+// int n: number of descriptors.
+static void save_feature_cache(const char *path, feature_cache_header hd, descriptor *d, int n)
+{
+    char tmp[1200];
+    int seq;
+    #pragma omp atomic capture
+    seq = ++feature_cache_writes;
+    snprintf(tmp, sizeof(tmp), "%s.%d.%d.tmp", path, (int)getpid(), seq);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return;
+    hd.n = n;
+    hd.dim = n ? d[0].n : 0;
+    int ok = fwrite(&hd, sizeof(hd), 1, fp) == 1;
+    for (int i = 0; i < n && ok; i++) {
+        float xy[2] = {d[i].p.x, d[i].p.y};
+        ok = fwrite(xy, sizeof(float), 2, fp) == 2;
+    }
+    for (int i = 0; i < n && ok; i++) {
+        ok = d[i].n == hd.dim && fwrite(d[i].data, sizeof(float), hd.dim, fp) == (size_t)hd.dim;
+    }
+    ok &= fclose(fp) == 0;
+    if (!ok || rename(tmp, path)) remove(tmp);
+}
+
+// Harris corner detection that reuses results from earlier runs. With the
+// cache on (see set_feature_cache), features are stored in a file named
+// by a hash of the pixels and the detector parameters, and later calls
+// on the same image and parameters read them back without detecting.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int *n: pointer to number of corners detected, filled in.
+// returns: array of descriptors of the corners in the image.
+descriptor *harris_corner_detector_cached(image im, float sigma, float thresh, int nms, int *n)
+{
+    if (!feature_cache_dir[0]) return harris_corner_detector(im, sigma, thresh, nms, n);
+
+    feature_cache_header hd = {0};
+    hd.magic = FEATURE_CACHE_MAGIC;
+    hd.version = FEATURE_CACHE_VERSION;
+    hd.key = feature_key(im, sigma, thresh, nms);
+    hd.sigma = sigma;
+    hd.thresh = thresh;
+    hd.nms = nms;
+    hd.w = im.w; hd.h = im.h; hd.c = im.c;
+
+    char path[1100];
+    snprintf(path, sizeof(path), "%s/%016llx.feat", feature_cache_dir, hd.key);
+    descriptor *d = load_feature_cache(path, &hd, n);
+    if (d) return d;
+
+    d = harris_corner_detector(im, sigma, thresh, nms, n);
+    save_feature_cache(path, hd, d, *n);
+    return d;
+}
@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "matrix.h"
+
+// Bresenham circle of radius 3, clockwise from the top.
+static const int fast_circle[16][2] = {
+    { 0, -3}, { 1, -3}, { 2, -2}, { 3, -1},
+    { 3,  0}, { 3,  1}, { 2,  2}, { 1,  3},
+    { 0,  3}, {-1,  3}, {-2,  2}, {-3,  1},
+    {-3,  0}, {-3, -1}, {-2, -2}, {-1, -3}
+};
+
+// Check a 16 bit circle mask for a contiguous arc of set bits.
+// unsigned mask: one bit per circle pixel.
+// int arc: required arc length.
+// returns: 1 if the mask has arc contiguous bits, wrapping around.
+static int has_arc(unsigned mask, int arc)
+{
+    unsigned m = mask | (mask << 16);
+    unsigned r = m;
+    for (int i = 1; i < arc && r; i++) r &= m >> i;
+    return r != 0;
+}
+
+// FAST score: how far the arc pixels are past the threshold.
+// float *p: center pixel.
+// const int *off: circle offsets in the flattened image.
+// float thresh: intensity threshold.
+// returns: larger of the summed bright and dark excess.
+static float fast_score(const float *p, const int *off, float thresh)
+{
+    float bright = 0, dark = 0;
+    for (int i = 0; i < 16; i++) {
+        float d = p[off[i]] - p[0];
+        if (d > thresh) bright += d - thresh;
+        if (d < -thresh) dark += -d - thresh;
+    }
+    return MAX(bright, dark);
+}
+
+// Harris response at a single pixel, Gaussian weighted structure matrix
+// over a window, for scoring only the pixels that pass the segment test.
+// image im: grayscale image.
+// int x, y: pixel to score.
+// image g: 1d Gaussian weights.
+// returns: det(S) - alpha * trace(S)^2, alpha = .06
+float harris_score_at(image im, int x, int y, image g)
+{
+    int r = g.w/2;
+    float sxx = 0, syy = 0, sxy = 0;
+    for (int dy = -r; dy <= r; dy++) {
+        for (int dx = -r; dx <= r; dx++) {
+            int u = x + dx, v = y + dy;
+            float ix = (get_pixel(im, u+1, v-1, 0) + 2*get_pixel(im, u+1, v, 0) + get_pixel(im, u+1, v+1, 0))
+                     - (get_pixel(im, u-1, v-1, 0) + 2*get_pixel(im, u-1, v, 0) + get_pixel(im, u-1, v+1, 0));
+            float iy = (get_pixel(im, u-1, v+1, 0) + 2*get_pixel(im, u, v+1, 0) + get_pixel(im, u+1, v+1, 0))
+                     - (get_pixel(im, u-1, v-1, 0) + 2*get_pixel(im, u, v-1, 0) + get_pixel(im, u+1, v-1, 0));
+            float w = g.data[dx + r]*g.data[dy + r];
+            sxx += w*ix*ix;
+            syy += w*iy*iy;
+            sxy += w*ix*iy;
+        }
+    }
+    float det = sxx*syy - sxy*sxy;
+    float trace = sxx + syy;
+    return det - 0.06 * trace * trace;
+}
+
+// Detect corners with the FAST segment test. A pixel is a corner if arc
+// contiguous pixels on a radius 3 circle around it are all brighter or
+// all darker than it by more than thresh. A branch-free test on the four
+// compass pixels rejects most pixels for a whole row at a time first.
+// image im: input image.
+// float thresh: intensity threshold. Typical: .05-.2
+// int arc: contiguous arc length, 9 to 12.
+// int nms: distance to look for local-maxes in the score map.
+// int harris: 1 to score survivors with the Harris response instead of
+//             the FAST score.
+// int *n: pointer to number of corners detected, filled in.
+// returns: array of descriptors of the corners, same as harris_corner_detector.
+descriptor *fast_corner_detector(image im, float thresh, int arc, int nms, int harris, int *n)
+{
+    assert(arc >= 9 && arc <= 12);
+    image gray = im.c == 3 ? rgb_to_grayscale(im) : copy_image(im);
+    image score = make_image(im.w, im.h, 1);
+    image g = make_1d_gaussian(1);
+    int w = gray.w;
+    int off[16];
+    for (int i = 0; i < 16; i++) off[i] = fast_circle[i][1]*w + fast_circle[i][0];
+    // An arc of 9 always covers 2 compass points, an arc of 12 covers 3.
+    int need = arc >= 12 ? 3 : 2;
+
+    #pragma omp parallel
+    {
+        unsigned char *pass = calloc(w, sizeof(unsigned char));
+        #pragma omp for schedule(dynamic, 8)
+        for (int y = 3; y < gray.h - 3; y++) {
+            const float *row = gray.data + y*w;
+            for (int x = 3; x < w - 3; x++) {
+                float c = row[x];
+                float a0 = row[x + off[0]], a1 = row[x + off[4]];
+                float a2 = row[x + off[8]], a3 = row[x + off[12]];
+                int b = (a0 > c + thresh) + (a1 > c + thresh) + (a2 > c + thresh) + (a3 > c + thresh);
+                int d = (a0 < c - thresh) + (a1 < c - thresh) + (a2 < c - thresh) + (a3 < c - thresh);
+                pass[x] = (b >= need) | (d >= need);
+            }
+            for (int x = 3; x < w - 3; x++) {
+                if (!pass[x]) continue;
+                const float *p = row + x;
+                unsigned bright = 0, dark = 0;
+                for (int i = 0; i < 16; i++) {
+                    float v = p[off[i]];
+                    bright |= (unsigned)(v > p[0] + thresh) << i;
+                    dark |= (unsigned)(v < p[0] - thresh) << i;
+                }
+                if (!has_arc(bright, arc) && !has_arc(dark, arc)) continue;
+                float s = harris ? harris_score_at(gray, x, y, g) : fast_score(p, off, thresh);
+                // Keep corners with a non-positive Harris score out of NMS.
+                score.data[y*w + x] = s > 0 ? s : 0;
+            }
+        }
+        free(pass);
+    }
+
+    int count = 0;
+    peak *p = nms_peaks(score, nms, 0, &count);
+    descriptor *d = calloc(count + 1, sizeof(descriptor));
+    for (int i = 0; i < count; i++) {
+        d[i] = describe_index(im, (int)p[i].p.y * im.w + (int)p[i].p.x);
+    }
+    free(p);
+    free_image(gray);
+    free_image(score);
+    free_image(g);
+    *n = count;
+    return d;
+}
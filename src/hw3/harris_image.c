@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <assert.h>
 #include "image.h"
 #include "matrix.h"
@@ -19,18 +20,13 @@ void free_descriptors(descriptor *d, int n)
     free(d);
 }
 
-// Create a feature descriptor for an index in an image.
+// Write the feature descriptor for an index in an image into a buffer.
 // image im: source image.
 // int i: index in image for the pixel we want to describe.
-// returns: descriptor for that index.
-descriptor describe_index(image im, int i)
+// float *out: buffer for the 5*5*im.c descriptor values.
+void describe_index_into(image im, int i, float *out)
 {
     int w = 5;
-    descriptor d;
-    d.p.x = i%im.w;
-    d.p.y = i/im.w;
-    d.data = calloc(w*w*im.c, sizeof(float));
-    d.n = w*w*im.c;
     int c, dx, dy;
     int count = 0;
     // If you want you can experiment with other descriptors
@@ -41,13 +37,70 @@ descriptor describe_index(image im, int i)
         for(dx = -w/2; dx < (w+1)/2; ++dx){
             for(dy = -w/2; dy < (w+1)/2; ++dy){
                 float val = get_pixel(im, i%im.w+dx, i/im.w+dy, c);
-                d.data[count++] = cval - val;
+                out[count++] = cval - val;
             }
         }
     }
+}
+
+// Create a feature descriptor for an index in an image.
+// image im: source image.
+// int i: index in image for the pixel we want to describe.
+// returns: descriptor for that index.
+descriptor describe_index(image im, int i)
+{
+    int w = 5;
+    descriptor d;
+    d.p.x = i%im.w;
+    d.p.y = i/im.w;
+    d.data = calloc(w*w*im.c, sizeof(float));
+    d.n = w*w*im.c;
+    describe_index_into(im, i, d.data);
     return d;
 }
 
+// Allocate a descriptor set as one aligned block. Descriptor rows are
+// padded with zeros to a multiple of 8 floats, which doesn't change
+// their L1 distance.
+// int n: number of descriptors.
+// int dim: number of floats per descriptor.
+// returns: zeroed descriptor set.
+descriptor_set make_descriptor_set(int n, int dim)
+{
+    descriptor_set s;
+    s.n = n;
+    s.dim = dim;
+    s.stride = (dim + 7) & ~7;
+    size_t floats = (size_t)n*s.stride + 2*(size_t)((n + 15) & ~15);
+    size_t bytes = (floats*sizeof(float) + 63) & ~(size_t)63;
+    s.data = aligned_alloc(64, bytes ? bytes : 64);
+    memset(s.data, 0, bytes);
+    s.x = s.data + (size_t)n*s.stride;
+    s.y = s.x + ((n + 15) & ~15);
+    return s;
+}
+
+// Frees a descriptor set, everything lives in a single block.
+void free_descriptor_set(descriptor_set s)
+{
+    free(s.data);
+}
+
+// Pack an array of descriptors into a descriptor set.
+// descriptor *d: the array, all descriptors should have the same length.
+// int n: number of elements in array.
+// returns: descriptor set with copies of the descriptors.
+descriptor_set descriptors_to_set(descriptor *d, int n)
+{
+    descriptor_set s = make_descriptor_set(n, n ? d[0].n : 0);
+    for (int i = 0; i < n; i++) {
+        s.x[i] = d[i].p.x;
+        s.y[i] = d[i].p.y;
+        memcpy(s.data + (size_t)i*s.stride, d[i].data, s.dim*sizeof(float));
+    }
+    return s;
+}
+
 // Marks the spot of a point in an image.
 // image im: image to mark.
 // ponit p: spot to mark in the image.
@@ -83,8 +136,14 @@ void mark_corners(image im, descriptor *d, int n)
 // returns: single row image of the filter.
 image make_1d_gaussian(float sigma)
 {
-    // TODO: optional, make separable 1d Gaussian.
-    return make_image(1,1,1);
+    int tmp = ceil(sigma * 6);
+    int w = (tmp % 2) ? tmp : tmp + 1;
+    image filter = make_image(w, 1, 1);
+    for (int x = 0; x < w; x++) {
+        filter.data[x] = exp(-1 * (x-w/2)*(x-w/2) / (2*sigma*sigma));
+    }
+    l1_normalize(filter);
+    return filter;
 }
 
 // Smooths an image using separable Gaussian filter.
@@ -114,8 +173,10 @@ image structure_matrix(image im, float sigma)
 {
     image S = make_image(im.w, im.h, 3);
     // TODO: calculate structure matrix for im.
-    image Ix = convolve_image(im, make_gx_filter(), 0);
-    image Iy = convolve_image(im, make_gy_filter(), 0);
+    image gx = make_gx_filter();
+    image gy = make_gy_filter();
+    image Ix = convolve_image(im, gx, 0);
+    image Iy = convolve_image(im, gy, 0);
     for (int x = 0; x < Ix.w; x++) {
         for (int y = 0; y < Ix.h; y++) {
             set_pixel(S, x, y, 0, pow(get_pixel(Ix, x, y, 0), 2));
@@ -123,7 +184,12 @@ image structure_matrix(image im, float sigma)
             set_pixel(S, x, y, 2, get_pixel(Ix, x, y, 0) * get_pixel(Iy, x, y, 0));
         }
     }
-    return convolve_image(S, make_gaussian_filter(sigma), 1);
+    image g = make_gaussian_filter(sigma);
+    image smoothed = convolve_image(S, g, 1);
+    free_image(gx); free_image(gy);
+    free_image(Ix); free_image(Iy);
+    free_image(S); free_image(g);
+    return smoothed;
 }
 
 // Estimate the cornerness of each pixel given a structure matrix S.
@@ -144,6 +210,75 @@ image cornerness_response(image S)
     return R;
 }
 
+// Running max over a window of 2r+1 vectors, van Herk/Gil-Werman style.
+// Costs three max operations per element no matter how big the window is.
+// The window is truncated at the ends, same as clamping to the border.
+// const float *in: n vectors of len floats, vector i starts at i*len.
+// float *out: n vectors of len floats, the result.
+// int n, len: number and length of vectors.
+// int r: radius of the window.
+void running_max(const float *in, float *out, int n, int len, int r)
+{
+    int k = 2*r + 1;
+    int np = n + 2*r;
+    float *g = malloc((size_t)np*len*sizeof(float));
+    float *h = malloc((size_t)np*len*sizeof(float));
+    int p, e;
+    // Prefix max within each block of k, suffix max within each block.
+    for (p = 0; p < np; p++) {
+        float *gp = g + (size_t)p*len;
+        int in_range = p >= r && p < n + r;
+        const float *src = in + (size_t)(p - r)*len;
+        if (p % k == 0) {
+            for (e = 0; e < len; e++) gp[e] = in_range ? src[e] : -FLT_MAX;
+        } else {
+            float *prev = gp - len;
+            for (e = 0; e < len; e++) gp[e] = in_range ? MAX(prev[e], src[e]) : prev[e];
+        }
+    }
+    for (p = np - 1; p >= 0; p--) {
+        float *hp = h + (size_t)p*len;
+        int in_range = p >= r && p < n + r;
+        const float *src = in + (size_t)(p - r)*len;
+        if (p % k == k - 1 || p == np - 1) {
+            for (e = 0; e < len; e++) hp[e] = in_range ? src[e] : -FLT_MAX;
+        } else {
+            float *next = hp + len;
+            for (e = 0; e < len; e++) hp[e] = in_range ? MAX(next[e], src[e]) : next[e];
+        }
+    }
+    for (p = 0; p < n; p++) {
+        float *hp = h + (size_t)p*len;
+        float *gp = g + (size_t)(p + k - 1)*len;
+        float *op = out + (size_t)p*len;
+        for (e = 0; e < len; e++) op[e] = MAX(hp[e], gp[e]);
+    }
+    free(g);
+    free(h);
+}
+
+// Max filter an image with a (2w+1)x(2w+1) window, clamping at the border.
+// image im: image to filter.
+// int w: radius of the window.
+// returns: image where each pixel is the max of its neighborhood in im.
+image max_filter_image(image im, int w)
+{
+    image rows = make_image(im.w, im.h, im.c);
+    image m = make_image(im.w, im.h, im.c);
+    for (int c = 0; c < im.c; c++) {
+        float *src = im.data + c*im.w*im.h;
+        float *tmp = rows.data + c*im.w*im.h;
+        #pragma omp parallel for
+        for (int y = 0; y < im.h; y++) {
+            running_max(src + y*im.w, tmp + y*im.w, im.w, 1, w);
+        }
+        // Columns are filtered a whole row at a time so memory is walked in order.
+        running_max(tmp, m.data + c*im.w*im.h, im.h, im.w, w);
+    }
+    free_image(rows);
+    return m;
+}
+
 // Perform non-max supression on an image of feature responses.
 // image im: 1-channel image of feature responses.
 // int w: distance to look for larger responses.
@@ -151,27 +286,158 @@ image cornerness_response(image S)
 image nms_image(image im, int w)
 {
     image r = copy_image(im);
-    // TODO: perform NMS on the response map.
-    // for every pixel in the image:
-    //     for neighbors within w:
-    //         if neighbor response greater than pixel response:
-    //             set response to be very low (I use -999999 [why not 0??])
-    for (int x = 0; x < r.w; x++) {
-        for (int y = 0; y < r.h; y++) {
-            int has_greater = 0;
-            for (int m = x - w; m <= x + w; m++) {
-                for (int n = y - w; n <= y + w; n++) {
-                    if (get_pixel(im, m, n, 0) > get_pixel(im, x, y, 0)) has_greater = 1;
-                    if (has_greater) break;
-                }
-                if (has_greater) break;
+    // A pixel survives if nothing within w pixels is larger,
+    // i.e. it equals the max of its window.
+    image m = max_filter_image(im, w);
+    for (int i = 0; i < r.w*r.h*r.c; i++) {
+        if (im.data[i] < m.data[i]) r.data[i] = -999999;
+    }
+    free_image(m);
+    return r;
+}
+
+// Find local maxima of a response map above a threshold.
+// image im: 1-channel image of responses, any detector.
+// int w: distance to look for larger responses.
+// float thresh: only peaks with response > thresh are kept.
+// int *n: pointer to number of peaks found, filled in.
+// returns: array of peaks in row-major order.
+peak *nms_peaks(image im, int w, float thresh, int *n)
+{
+    image m = max_filter_image(im, w);
+    int count = 0, size = 64;
+    peak *p = calloc(size, sizeof(peak));
+    for (int y = 0; y < im.h; y++) {
+        for (int x = 0; x < im.w; x++) {
+            float v = im.data[y*im.w + x];
+            if (!(v > thresh) || v < m.data[y*im.w + x]) continue;
+            if (count == size) {
+                size *= 2;
+                p = realloc(p, size*sizeof(peak));
             }
-            if (has_greater) {
-                set_pixel(r, x, y, 0, -999999);
+            p[count].p = make_point(x, y);
+            p[count].v = v;
+            ++count;
+        }
+    }
+    free_image(m);
+    *n = count;
+    return p;
+}
+
+// Restore the min-heap property below a node of a heap of indices.
+// int *heap: indices into key, heap[0] has the smallest key.
+// int n: size of the heap.
+// int i: node to sift down.
+// const float *key: values the heap is ordered by.
+void sift_down(int *heap, int n, int i, const float *key)
+{
+    while (1) {
+        int l = 2*i + 1, r = l + 1, m = i;
+        if (l < n && key[heap[l]] < key[heap[m]]) m = l;
+        if (r < n && key[heap[r]] < key[heap[m]]) m = r;
+        if (m == i) return;
+        int tmp = heap[i]; heap[i] = heap[m]; heap[m] = tmp;
+        i = m;
+    }
+}
+
+// Select the k largest keys with a bounded min-heap, O(n log k).
+// const float *key: values to select from.
+// int n: number of values.
+// int k: how many to keep.
+// int *idx: filled with indices of the kept values, largest key first.
+// returns: number of indices written, min(n, k).
+int top_k_indices(const float *key, int n, int k, int *idx)
+{
+    int size = 0;
+    for (int i = 0; i < n && k > 0; i++) {
+        if (size < k) {
+            // Push and sift up.
+            int j = size++;
+            idx[j] = i;
+            while (j > 0 && key[idx[(j-1)/2]] > key[idx[j]]) {
+                int tmp = idx[j]; idx[j] = idx[(j-1)/2]; idx[(j-1)/2] = tmp;
+                j = (j-1)/2;
             }
+        } else if (key[i] > key[idx[0]]) {
+            idx[0] = i;
+            sift_down(idx, size, 0, key);
         }
     }
-    return r;
+    // Heap sort in place, popping the smallest to the back.
+    for (int j = size - 1; j > 0; j--) {
+        int tmp = idx[0]; idx[0] = idx[j]; idx[j] = tmp;
+        sift_down(idx, j, 0, key);
+    }
+    return size;
+}
+
+// Keep the k strongest peaks.
+// peak *p: peaks to choose from.
+// int n: number of peaks.
+// int k: corner budget.
+// int *kn: pointer to number of peaks kept, filled in.
+// returns: newly allocated array of the kept peaks, strongest first.
+peak *top_k_peaks(peak *p, int n, int k, int *kn)
+{
+    float *key = calloc(n, sizeof(float));
+    int *idx = calloc(MIN(n, k) + 1, sizeof(int));
+    for (int i = 0; i < n; i++) key[i] = p[i].v;
+    int m = top_k_indices(key, n, k, idx);
+    peak *out = calloc(m + 1, sizeof(peak));
+    for (int i = 0; i < m; i++) out[i] = p[idx[i]];
+    free(key);
+    free(idx);
+    *kn = m;
+    return out;
+}
+
+// Comparator for peaks, strongest first.
+int peak_compare(const void *a, const void *b)
+{
+    const peak *pa = a;
+    const peak *pb = b;
+    if (pa->v > pb->v) return -1;
+    else if (pa->v < pb->v) return 1;
+    else return 0;
+}
+
+// Adaptive non-maximal suppression: keep the k peaks with the largest
+// suppression radius, the distance to the nearest sufficiently stronger
+// peak. Spreads the kept peaks evenly over the image.
+// peak *p: peaks to choose from.
+// int n: number of peaks.
+// int k: corner budget.
+// float robust: peak j suppresses i if v_i < robust * v_j. Typical: .9
+// int *kn: pointer to number of peaks kept, filled in.
+// returns: newly allocated array of the kept peaks, largest radius first.
+peak *anms_peaks(peak *p, int n, int k, float robust, int *kn)
+{
+    peak *sorted = calloc(n + 1, sizeof(peak));
+    memcpy(sorted, p, n*sizeof(peak));
+    qsort(sorted, n, sizeof(peak), peak_compare);
+    float *radius = calloc(n + 1, sizeof(float));
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < n; i++) {
+        float best = FLT_MAX;
+        // Only stronger peaks can suppress, and they are all before i.
+        for (int j = 0; j < i && sorted[i].v < robust*sorted[j].v; j++) {
+            float dx = sorted[i].p.x - sorted[j].p.x;
+            float dy = sorted[i].p.y - sorted[j].p.y;
+            best = MIN(best, dx*dx + dy*dy);
+        }
+        radius[i] = best;
+    }
+    int *idx = calloc(MIN(n, k) + 1, sizeof(int));
+    int m = top_k_indices(radius, n, k, idx);
+    peak *out = calloc(m + 1, sizeof(peak));
+    for (int i = 0; i < m; i++) out[i] = sorted[idx[i]];
+    free(sorted);
+    free(radius);
+    free(idx);
+    *kn = m;
+    return out;
 }
 
 // Perform harris corner detection and extract features from the corners.
@@ -189,31 +455,271 @@ descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms,
     // Estimate cornerness
     image R = cornerness_response(S);
 
-    // Run NMS on the responses
-    image Rnms = nms_image(R, nms);
+    // Run NMS on the responses, keeping peaks over threshold
+    int count = 0;
+    peak *p = nms_peaks(R, nms, thresh, &count);
 
+    *n = count; // <- set *n equal to number of corners in image.
+    descriptor *d = calloc(count, sizeof(descriptor));
+    for (int i = 0; i < count; i++) {
+        d[i] = describe_index(im, (int)p[i].p.y * im.w + (int)p[i].p.x);
+    }
+
+    free_image(S);
+    free_image(R);
+    free(p);
+    return d;
+}
+
+// Perform harris corner detection into a contiguous descriptor set.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// returns: descriptor set of the corners in the image.
+descriptor_set harris_corner_detector_set(image im, float sigma, float thresh, int nms)
+{
+    image S = structure_matrix(im, sigma);
+    image R = cornerness_response(S);
 
-    //TODO: count number of responses over threshold
     int count = 0;
-    for (int x = 0; x < Rnms.w; x++) {
-        for (int y = 0; y < Rnms.h; y++) {
-            if (get_pixel(Rnms, x, y, 0) > thresh) count++;
-        }
+    peak *p = nms_peaks(R, nms, thresh, &count);
+    descriptor_set d = make_descriptor_set(count, 5*5*im.c);
+    #pragma omp parallel for
+    for (int i = 0; i < count; i++) {
+        d.x[i] = p[i].p.x;
+        d.y[i] = p[i].p.y;
+        describe_index_into(im, (int)p[i].p.y * im.w + (int)p[i].p.x, d.data + (size_t)i*d.stride);
     }
-    
-    *n = count; // <- set *n equal to number of corners in image.
+
+    free_image(S);
+    free_image(R);
+    free(p);
+    return d;
+}
+
+// Perform harris corner detection with a fixed corner budget.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int budget: maximum number of corners to return.
+// int anms: 0 keeps the strongest corners, 1 uses adaptive non-maximal
+//           suppression for even coverage.
+// int *n: pointer to number of corners detected, filled in.
+// returns: array of descriptors of at most budget corners.
+descriptor *harris_corner_detector_budget(image im, float sigma, float thresh, int nms, int budget, int anms, int *n)
+{
+    image S = structure_matrix(im, sigma);
+    image R = cornerness_response(S);
+
+    int pn = 0, count = 0;
+    peak *p = nms_peaks(R, nms, thresh, &pn);
+    peak *kept = anms ? anms_peaks(p, pn, budget, .9, &count) : top_k_peaks(p, pn, budget, &count);
+
+    *n = count;
     descriptor *d = calloc(count, sizeof(descriptor));
-    //TODO: fill in array *d with descriptors of corners, use describe_index.
-    int i = 0;
-    for (int x = 0; x < Rnms.w; x++) {
-        for (int y = 0; y < Rnms.h; y++) {
-            if (get_pixel(Rnms, x, y, 0) > thresh) d[i++] = describe_index(im, y * Rnms.w + x);
-        }
+    for (int i = 0; i < count; i++) {
+        d[i] = describe_index(im, (int)kept[i].p.y * im.w + (int)kept[i].p.x);
     }
 
     free_image(S);
     free_image(R);
-    free_image(Rnms);
+    free(p);
+    free(kept);
+    return d;
+}
+
+// Perform harris corner detection cell by cell over a grid. Each cell is
+// detected with a halo wide enough that its corners match the whole-image
+// detector, cells run in parallel, and each keeps its strongest corners.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int cols, rows: grid size.
+// int per_cell: corners to keep per cell, <= 0 keeps all of them.
+// int *n: pointer to number of corners detected, filled in.
+// returns: array of descriptors of the corners, cell by cell.
+descriptor *harris_corner_detector_grid(image im, float sigma, float thresh, int nms, int cols, int rows, int per_cell, int *n)
+{
+    image g = make_gaussian_filter(sigma);
+    int halo = 1 + g.w/2 + nms;
+    free_image(g);
+    int cells = cols*rows;
+    peak **found = calloc(cells, sizeof(peak *));
+    int *counts = calloc(cells, sizeof(int));
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < cells; c++) {
+        int x0 = (c % cols)*im.w/cols, x1 = (c % cols + 1)*im.w/cols;
+        int y0 = (c / cols)*im.h/rows, y1 = (c / cols + 1)*im.h/rows;
+        int cx = MAX(x0 - halo, 0), cy = MAX(y0 - halo, 0);
+        image crop = crop_image(im, cx, cy, x1 + halo - cx, y1 + halo - cy);
+        image S = structure_matrix(crop, sigma);
+        image R = cornerness_response(S);
+        int pn = 0, kept = 0;
+        peak *p = nms_peaks(R, nms, thresh, &pn);
+        // Only keep peaks in the cell itself, not its halo.
+        for (int i = 0; i < pn; i++) {
+            int x = p[i].p.x + cx, y = p[i].p.y + cy;
+            if (x < x0 || x >= x1 || y < y0 || y >= y1) continue;
+            p[kept].p = make_point(x, y);
+            p[kept].v = p[i].v;
+            ++kept;
+        }
+        if (per_cell > 0 && kept > per_cell) {
+            peak *top = top_k_peaks(p, kept, per_cell, &kept);
+            free(p);
+            p = top;
+        }
+        found[c] = p;
+        counts[c] = kept;
+        free_image(crop);
+        free_image(S);
+        free_image(R);
+    }
+
+    int count = 0;
+    for (int c = 0; c < cells; c++) count += counts[c];
+    descriptor *d = calloc(count + 1, sizeof(descriptor));
+    int i = 0;
+    for (int c = 0; c < cells; c++) {
+        for (int j = 0; j < counts[c]; j++) {
+            d[i++] = describe_index(im, (int)found[c][j].p.y * im.w + (int)found[c][j].p.x);
+        }
+        free(found[c]);
+    }
+    free(found);
+    free(counts);
+    *n = count;
+    return d;
+}
+
+// Compute one row of Ix^2, Iy^2, IxIy for the streaming detector.
+// Gradients match convolve_image(im, make_g*_filter(), 0): all channels
+// are summed and the border is clamped.
+// image im: input image.
+// image gx, gy: 3x3 gradient filters.
+// int y: row to compute.
+// float *t: output, 3 rows of im.w floats.
+void harris_tensor_row(image im, image gx, image gy, int y, float *t)
+{
+    int w = im.w;
+    int rows[3] = {MAX(y-1, 0), y, MIN(y+1, im.h-1)};
+    for (int x = 0; x < w; x++) {
+        int cols[3] = {MAX(x-1, 0), x, MIN(x+1, w-1)};
+        float ix = 0, iy = 0;
+        for (int k = 0; k < im.c; k++) {
+            float *p = im.data + k*w*im.h;
+            for (int m = 0; m < 3; m++) {
+                for (int n = 0; n < 3; n++) {
+                    float v = p[rows[m]*w + cols[n]];
+                    ix += v*gx.data[m*3 + n];
+                    iy += v*gy.data[m*3 + n];
+                }
+            }
+        }
+        t[x] = ix*ix;
+        t[w + x] = iy*iy;
+        t[2*w + x] = ix*iy;
+    }
+}
+
+// Horizontally blur a row with a 1d filter, clamping at the border.
+// float *in, *out: row of w floats.
+// int w: row length.
+// image g: 1d filter.
+void blur_row(float *in, float *out, int w, image g)
+{
+    int r = g.w/2;
+    for (int x = 0; x < w; x++) {
+        float sum = 0;
+        for (int n = 0; n < g.w; n++) {
+            int xx = MIN(MAX(x - r + n, 0), w-1);
+            sum += in[xx]*g.data[n];
+        }
+        out[x] = sum;
+    }
+}
+
+// Perform harris corner detection streaming rows through every stage.
+// Gradients, the smoothed structure matrix and the response are kept in
+// ring buffers of a few rows, so working memory is O(width * kernel)
+// instead of several full frames. Finds the same corners as
+// harris_corner_detector, in row-major order.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int *n: pointer to number of corners detected, filled in.
+// returns: array of descriptors of the corners in the image.
+descriptor *harris_corner_detector_stream(image im, float sigma, float thresh, int nms, int *n)
+{
+    int w = im.w, h = im.h;
+    image gx = make_gx_filter();
+    image gy = make_gy_filter();
+    image g = make_1d_gaussian(sigma);
+    int r = g.w/2;
+    int hk = 2*r + 1;       // rows of horizontally blurred tensor kept
+    int rk = 2*nms + 1;     // rows of response kept
+
+    float *t = calloc(3*w, sizeof(float));
+    float *hbuf = calloc(hk*3*w, sizeof(float));
+    float *rbuf = calloc(rk*w, sizeof(float));
+
+    int next_h = 0, next_r = 0;
+    int count = 0, size = 64;
+    descriptor *d = calloc(size, sizeof(descriptor));
+
+    for (int y = 0; y < h; y++) {
+        // Fill the response rows nms needs for row y.
+        while (next_r <= MIN(h-1, y + nms)) {
+            // Fill the blurred tensor rows the vertical blur needs.
+            while (next_h <= MIN(h-1, next_r + r)) {
+                harris_tensor_row(im, gx, gy, next_h, t);
+                float *hrow = hbuf + (next_h % hk)*3*w;
+                for (int k = 0; k < 3; k++) blur_row(t + k*w, hrow + k*w, w, g);
+                ++next_h;
+            }
+            float *rrow = rbuf + (next_r % rk)*w;
+            for (int x = 0; x < w; x++) {
+                float s[3] = {0, 0, 0};
+                for (int m = 0; m < g.w; m++) {
+                    int yy = MIN(MAX(next_r - r + m, 0), h-1);
+                    float *hrow = hbuf + (yy % hk)*3*w;
+                    for (int k = 0; k < 3; k++) s[k] += hrow[k*w + x]*g.data[m];
+                }
+                float det = s[0]*s[1] - s[2]*s[2];
+                float trace = s[0] + s[1];
+                rrow[x] = det - 0.06 * trace * trace;
+            }
+            ++next_r;
+        }
+
+        float *row = rbuf + (y % rk)*w;
+        for (int x = 0; x < w; x++) {
+            float v = row[x];
+            if (!(v > thresh)) continue;
+            int keep = 1;
+            for (int m = -nms; m <= nms && keep; m++) {
+                float *nrow = rbuf + (MIN(MAX(y+m, 0), h-1) % rk)*w;
+                for (int dx = -nms; dx <= nms; dx++) {
+                    if (nrow[MIN(MAX(x+dx, 0), w-1)] > v) { keep = 0; break; }
+                }
+            }
+            if (!keep) continue;
+            if (count == size) {
+                size *= 2;
+                d = realloc(d, size*sizeof(descriptor));
+            }
+            d[count++] = describe_index(im, y*w + x);
+        }
+    }
+
+    free(t); free(hbuf); free(rbuf);
+    free_image(gx); free_image(gy); free_image(g);
+    *n = count;
     return d;
 }
 
@@ -227,4 +733,5 @@ void detect_and_draw_corners(image im, float sigma, float thresh, int nms)
     int n = 0;
     descriptor *d = harris_corner_detector(im, sigma, thresh, nms, &n);
     mark_corners(im, d, n);
+    free_descriptors(d, n);
 }
@@ -0,0 +1,607 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <assert.h>
+#include "image.h"
+#include "matrix.h"
+
+// Tile sizes for blocked matching. A query tile and a candidate tile of
+// 75-float (padded to 80) descriptors fit comfortably in L2.
+#define QUERY_TILE 32
+#define CANDIDATE_TILE 256
+
+// L1 distance between two padded descriptor rows, accumulated in 8 lanes
+// so the compiler can keep it in vector registers.
+// const float *a, *b: rows to compare, n floats each.
+// int n: row length, a multiple of 8.
+// returns: sum of absolute differences.
+static inline float l1_distance_padded(const float *a, const float *b, int n)
+{
+    float acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    for (int i = 0; i < n; i += 8) {
+        for (int l = 0; l < 8; l++) {
+            acc[l] += fabsf(a[i + l] - b[i + l]);
+        }
+    }
+    return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+}
+
+// L1 distance that gives up early. Partial sums are checked after every
+// 8 floats and abandoned once they exceed bound.
+// const float *a, *b: rows to compare, n floats each.
+// int n: row length, a multiple of 8.
+// float bound: distances above this aren't needed exactly.
+// returns: the L1 distance, or a partial sum > bound.
+static inline float l1_distance_bounded(const float *a, const float *b, int n, float bound)
+{
+    float sum = 0;
+    for (int i = 0; i < n; i += 8) {
+        float acc[8];
+        for (int l = 0; l < 8; l++) acc[l] = fabsf(a[i + l] - b[i + l]);
+        sum += ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+        if (sum > bound) return sum;
+    }
+    return sum;
+}
+
+// Keep the two smallest distances seen so far.
+// knn2 *k: running result for one query.
+// int i: candidate index.
+// float d: candidate distance.
+static inline void knn2_update(knn2 *k, int i, float d)
+{
+    if (d < k->d1) {
+        k->second = k->best; k->d2 = k->d1;
+        k->best = i; k->d1 = d;
+    } else if (d < k->d2) {
+        k->second = i; k->d2 = d;
+    }
+}
+
+// Find the nearest and second nearest neighbour in b of every descriptor
+// in a by brute force. Queries and candidates are processed in tiles that
+// stay in cache, and query tiles are split across threads.
+// descriptor_set a: query descriptors.
+// descriptor_set b: candidate descriptors, same dim as a.
+// returns: a.n results, indices are -1 and distances FLT_MAX when b has
+//          fewer than two descriptors.
+knn2 *knn2_descriptor_set(descriptor_set a, descriptor_set b)
+{
+    assert(a.n == 0 || b.n == 0 || a.stride == b.stride);
+    knn2 *r = calloc(a.n + 1, sizeof(knn2));
+    int tiles = (a.n + QUERY_TILE - 1)/QUERY_TILE;
+    #pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < tiles; t++) {
+        int q0 = t*QUERY_TILE;
+        int q1 = MIN(q0 + QUERY_TILE, a.n);
+        for (int q = q0; q < q1; q++) {
+            r[q].best = r[q].second = -1;
+            r[q].d1 = r[q].d2 = FLT_MAX;
+        }
+        for (int c0 = 0; c0 < b.n; c0 += CANDIDATE_TILE) {
+            int c1 = MIN(c0 + CANDIDATE_TILE, b.n);
+            for (int q = q0; q < q1; q++) {
+                const float *qa = a.data + (size_t)q*a.stride;
+                knn2 k = r[q];
+                for (int c = c0; c < c1; c++) {
+                    float d = l1_distance_bounded(qa, b.data + (size_t)c*b.stride, a.stride, k.d2);
+                    if (d < k.d2) knn2_update(&k, c, d);
+                }
+                r[q] = k;
+            }
+        }
+    }
+    return r;
+}
+
+// Finds matches that pass Lowe's ratio test and, optionally, a mutual
+// nearest neighbour check.
+// descriptor_set a, b: descriptors for pixels in two images.
+// float ratio: keep a match only if best < ratio * second best. Typical: .8
+// int mutual: also require a to be b's nearest neighbour.
+// int *mn: pointer to number of matches found, filled in.
+// returns: matches, one-to-one, sorted by distance.
+match *match_descriptor_set_ratio(descriptor_set a, descriptor_set b, float ratio, int mutual, int *mn)
+{
+    match *m = calloc(a.n + 1, sizeof(match));
+    *mn = 0;
+    if (!a.n || !b.n) return m;
+    knn2 *ab = knn2_descriptor_set(a, b);
+    knn2 *ba = mutual ? knn2_descriptor_set(b, a) : 0;
+    int n = 0;
+    for (int j = 0; j < a.n; j++) {
+        int bi = ab[j].best;
+        if (ab[j].d2 < FLT_MAX && !(ab[j].d1 < ratio*ab[j].d2)) continue;
+        if (mutual && ba[bi].best != j) continue;
+        m[n].ai = j;
+        m[n].bi = bi;
+        m[n].p = make_point(a.x[j], a.y[j]);
+        m[n].q = make_point(b.x[bi], b.y[bi]);
+        m[n].distance = ab[j].d1;
+        ++n;
+    }
+    free(ab);
+    free(ba);
+    *mn = n ? unique_matches(m, n, b.n) : 0;
+    return m;
+}
+
+// Ratio test and mutual check matching for arrays of descriptors.
+// descriptor *a, *b: array of descriptors for pixels in two images.
+// int an, bn: number of descriptors in arrays a and b.
+// float ratio: keep a match only if best < ratio * second best. Typical: .8
+// int mutual: also require a to be b's nearest neighbour.
+// int *mn: pointer to number of matches found, filled in.
+// returns: matches, one-to-one, sorted by distance.
+match *match_descriptors_ratio(descriptor *a, int an, descriptor *b, int bn, float ratio, int mutual, int *mn)
+{
+    descriptor_set sa = descriptors_to_set(a, an);
+    descriptor_set sb = descriptors_to_set(b, bn);
+    match *m = match_descriptor_set_ratio(sa, sb, ratio, mutual, mn);
+    free_descriptor_set(sa);
+    free_descriptor_set(sb);
+    return m;
+}
+
+// Private LCG so building an index doesn't disturb rand().
+// unsigned *state: generator state.
+// returns: pseudo-random number in [0, 2^24).
+static unsigned index_rand(unsigned *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+#define KD_LEAF_SIZE 32
+#define KD_TOP_DIMS 5
+
+// A node in a randomized k-d tree.
+// int dim: split dimension, -1 for a leaf.
+// float split: split value, smaller values go left.
+// int left, right: child node indexes.
+// int *items, n, cap, limit: leaf contents, split once n exceeds limit.
+typedef struct{
+    int dim;
+    float split;
+    int left, right;
+    int *items;
+    int n, cap, limit;
+} kd_node;
+
+typedef struct{
+    kd_node *nodes;
+    int n, cap;
+} kd_tree;
+
+struct kd_forest{
+    int trees;
+    kd_tree *tree;
+    int dim, stride;
+    int n, cap;
+    float *data, *x, *y;
+    unsigned seed;
+};
+
+// Add an empty leaf to a tree.
+// kd_tree *t: tree to grow.
+// returns: index of the new node.
+static int kd_new_leaf(kd_tree *t)
+{
+    if (t->n == t->cap) {
+        t->cap = t->cap ? 2*t->cap : 16;
+        t->nodes = realloc(t->nodes, t->cap*sizeof(kd_node));
+    }
+    kd_node *nd = t->nodes + t->n;
+    memset(nd, 0, sizeof(kd_node));
+    nd->dim = -1;
+    nd->limit = KD_LEAF_SIZE;
+    return t->n++;
+}
+
+static void kd_leaf_add(kd_node *nd, int item)
+{
+    if (nd->n == nd->cap) {
+        nd->cap = nd->cap ? 2*nd->cap : 8;
+        nd->items = realloc(nd->items, nd->cap*sizeof(int));
+    }
+    nd->items[nd->n++] = item;
+}
+
+// Split a full leaf on one of its highest variance dimensions, chosen at
+// random so the trees of the forest differ.
+// kd_forest *f: forest the tree belongs to.
+// kd_tree *t: tree.
+// int node: leaf to split.
+static void kd_split(kd_forest *f, kd_tree *t, int node)
+{
+    kd_node *nd = t->nodes + node;
+    int n = nd->n;
+    double *mean = calloc(f->dim, sizeof(double));
+    float *var = calloc(f->dim, sizeof(float));
+    for (int i = 0; i < n; i++) {
+        float *v = f->data + (size_t)nd->items[i]*f->stride;
+        for (int k = 0; k < f->dim; k++) mean[k] += v[k];
+    }
+    for (int k = 0; k < f->dim; k++) mean[k] /= n;
+    for (int i = 0; i < n; i++) {
+        float *v = f->data + (size_t)nd->items[i]*f->stride;
+        for (int k = 0; k < f->dim; k++) var[k] += (v[k] - mean[k])*(v[k] - mean[k]);
+    }
+    int top[KD_TOP_DIMS];
+    int ntop = top_k_indices(var, f->dim, KD_TOP_DIMS, top);
+    int dim = top[index_rand(&f->seed) % ntop];
+    float split = mean[dim];
+    free(mean);
+    free(var);
+
+    int left = 0;
+    for (int i = 0; i < n; i++) {
+        if (f->data[(size_t)nd->items[i]*f->stride + dim] < split) ++left;
+    }
+    if (left == 0 || left == n) {
+        // Every point is on one side, wait until the leaf is bigger.
+        nd->limit *= 2;
+        return;
+    }
+    int l = kd_new_leaf(t);
+    int r = kd_new_leaf(t);
+    nd = t->nodes + node;
+    for (int i = 0; i < nd->n; i++) {
+        int item = nd->items[i];
+        int side = f->data[(size_t)item*f->stride + dim] < split ? l : r;
+        kd_leaf_add(t->nodes + side, item);
+    }
+    free(nd->items);
+    nd->items = 0;
+    nd->n = nd->cap = 0;
+    nd->dim = dim;
+    nd->split = split;
+    nd->left = l;
+    nd->right = r;
+}
+
+// Make an empty randomized k-d forest for float descriptors.
+// int dim: number of floats per descriptor.
+// int trees: number of trees, more trees give better recall. Typical: 4
+// returns: the forest.
+kd_forest *make_kd_forest(int dim, int trees)
+{
+    kd_forest *f = calloc(1, sizeof(kd_forest));
+    f->trees = trees;
+    f->tree = calloc(trees, sizeof(kd_tree));
+    f->dim = dim;
+    f->stride = (dim + 7) & ~7;
+    f->seed = 2024;
+    for (int i = 0; i < trees; i++) kd_new_leaf(f->tree + i);
+    return f;
+}
+
+void free_kd_forest(kd_forest *f)
+{
+    for (int i = 0; i < f->trees; i++) {
+        for (int j = 0; j < f->tree[i].n; j++) free(f->tree[i].nodes[j].items);
+        free(f->tree[i].nodes);
+    }
+    free(f->tree);
+    free(f->data);
+    free(f->x);
+    free(f->y);
+    free(f);
+}
+
+// Insert descriptors into a forest, after the ones already there.
+// kd_forest *f: forest to grow.
+// descriptor_set s: descriptors to add, same dim as the forest.
+void kd_forest_insert(kd_forest *f, descriptor_set s)
+{
+    assert(s.n == 0 || s.dim == f->dim);
+    if (f->n + s.n > f->cap) {
+        f->cap = MAX(2*f->cap, f->n + s.n);
+        f->data = realloc(f->data, (size_t)f->cap*f->stride*sizeof(float));
+        f->x = realloc(f->x, f->cap*sizeof(float));
+        f->y = realloc(f->y, f->cap*sizeof(float));
+    }
+    memcpy(f->data + (size_t)f->n*f->stride, s.data, (size_t)s.n*f->stride*sizeof(float));
+    memcpy(f->x + f->n, s.x, s.n*sizeof(float));
+    memcpy(f->y + f->n, s.y, s.n*sizeof(float));
+    for (int i = f->n; i < f->n + s.n; i++) {
+        float *v = f->data + (size_t)i*f->stride;
+        for (int t = 0; t < f->trees; t++) {
+            kd_tree *tr = f->tree + t;
+            int node = 0;
+            while (tr->nodes[node].dim >= 0) {
+                kd_node *nd = tr->nodes + node;
+                node = v[nd->dim] < nd->split ? nd->left : nd->right;
+            }
+            kd_leaf_add(tr->nodes + node, i);
+            if (tr->nodes[node].n > tr->nodes[node].limit) kd_split(f, tr, node);
+        }
+    }
+    f->n += s.n;
+}
+
+// Number of descriptors in a forest.
+int kd_forest_size(kd_forest *f)
+{
+    return f->n;
+}
+
+// Keypoint of a descriptor in a forest.
+// int i: index in insertion order.
+point kd_forest_point(kd_forest *f, int i)
+{
+    return make_point(f->x[i], f->y[i]);
+}
+
+// A branch waiting to be searched, ordered by its distance bound.
+typedef struct{
+    float key;
+    int tree, node;
+} kd_branch;
+
+static void branch_push(kd_branch **h, int *n, int *cap, kd_branch b)
+{
+    if (*n == *cap) {
+        *cap = *cap ? 2 * *cap : 64;
+        *h = realloc(*h, *cap*sizeof(kd_branch));
+    }
+    int i = (*n)++;
+    while (i > 0 && (*h)[(i-1)/2].key > b.key) {
+        (*h)[i] = (*h)[(i-1)/2];
+        i = (i-1)/2;
+    }
+    (*h)[i] = b;
+}
+
+static kd_branch branch_pop(kd_branch *h, int *n)
+{
+    kd_branch top = h[0];
+    kd_branch last = h[--*n];
+    int i = 0;
+    while (1) {
+        int c = 2*i + 1;
+        if (c >= *n) break;
+        if (c + 1 < *n && h[c+1].key < h[c].key) ++c;
+        if (h[c].key >= last.key) break;
+        h[i] = h[c];
+        i = c;
+    }
+    if (*n) h[i] = last;
+    return top;
+}
+
+// Find approximate nearest and second nearest neighbours in a forest,
+// searching branches best-bin-first across all trees.
+// kd_forest *f: forest to search.
+// descriptor_set q: query descriptors, same dim as the forest.
+// int checks: descriptors to compare per query before giving up, the
+//             recall/speed knob. Typical: 32-512
+// returns: q.n results, indices are in forest insertion order.
+knn2 *kd_forest_knn2(kd_forest *f, descriptor_set q, int checks)
+{
+    assert(q.n == 0 || q.stride == f->stride);
+    knn2 *r = calloc(q.n + 1, sizeof(knn2));
+    #pragma omp parallel
+    {
+        int *seen = calloc(f->n + 1, sizeof(int));
+        kd_branch *heap = 0;
+        int hcap = 0;
+        #pragma omp for schedule(dynamic, 16)
+        for (int j = 0; j < q.n; j++) {
+            const float *v = q.data + (size_t)j*q.stride;
+            knn2 k = {-1, -1, FLT_MAX, FLT_MAX};
+            int hn = 0, checked = 0;
+            for (int t = 0; t < f->trees; t++) {
+                kd_branch b = {0, t, 0};
+                branch_push(&heap, &hn, &hcap, b);
+            }
+            while (hn && checked < checks) {
+                kd_branch b = branch_pop(heap, &hn);
+                if (b.key >= k.d2) continue;
+                kd_tree *tr = f->tree + b.tree;
+                int node = b.node;
+                while (tr->nodes[node].dim >= 0) {
+                    kd_node *nd = tr->nodes + node;
+                    float diff = v[nd->dim] - nd->split;
+                    kd_branch other = {b.key + fabsf(diff), b.tree, diff < 0 ? nd->right : nd->left};
+                    branch_push(&heap, &hn, &hcap, other);
+                    node = diff < 0 ? nd->left : nd->right;
+                }
+                kd_node *leaf = tr->nodes + node;
+                for (int i = 0; i < leaf->n; i++) {
+                    int item = leaf->items[i];
+                    if (seen[item] == j + 1) continue;
+                    seen[item] = j + 1;
+                    float d = l1_distance_padded(v, f->data + (size_t)item*f->stride, f->stride);
+                    if (d < k.d2) knn2_update(&k, item, d);
+                    ++checked;
+                }
+            }
+            r[j] = k;
+        }
+        free(seen);
+        free(heap);
+    }
+    return r;
+}
+
+// Match descriptors against a forest, e.g. the features of every image
+// stitched so far.
+// descriptor_set a: query descriptors.
+// kd_forest *f: forest to search.
+// int checks: recall/speed knob, see kd_forest_knn2.
+// int *mn: pointer to number of matches found, filled in.
+// returns: matches, one-to-one, sorted by distance. bi indexes the forest.
+match *match_kd_forest(descriptor_set a, kd_forest *f, int checks, int *mn)
+{
+    knn2 *k = kd_forest_knn2(f, a, checks);
+    match *m = calloc(a.n + 1, sizeof(match));
+    int n = 0;
+    for (int j = 0; j < a.n; j++) {
+        if (k[j].best < 0) continue;
+        m[n].ai = j;
+        m[n].bi = k[j].best;
+        m[n].p = make_point(a.x[j], a.y[j]);
+        m[n].q = kd_forest_point(f, k[j].best);
+        m[n].distance = k[j].d1;
+        ++n;
+    }
+    free(k);
+    *mn = n ? unique_matches(m, n, f->n) : 0;
+    return m;
+}
+
+struct lsh_index{
+    int tables, bits;
+    int *pos;
+    int **items;
+    int *count, *cap;
+    binary_descriptor *d;
+    int n, size;
+};
+
+// Make an empty multi-probe LSH index for binary descriptors. Each table
+// hashes a descriptor by a random subset of its bits.
+// int tables: number of hash tables, more tables give better recall. Typical: 6-12
+// int bits: bits per hash key, more bits give smaller buckets. Typical: 12-18
+// returns: the index.
+lsh_index *make_lsh_index(int tables, int bits)
+{
+    assert(bits > 0 && bits <= 24);
+    lsh_index *l = calloc(1, sizeof(lsh_index));
+    l->tables = tables;
+    l->bits = bits;
+    l->pos = calloc(tables*bits, sizeof(int));
+    unsigned seed = 4049;
+    for (int i = 0; i < tables*bits; i++) l->pos[i] = index_rand(&seed) % BRIEF_BITS;
+    size_t buckets = (size_t)tables << bits;
+    l->items = calloc(buckets, sizeof(int *));
+    l->count = calloc(buckets, sizeof(int));
+    l->cap = calloc(buckets, sizeof(int));
+    return l;
+}
+
+void free_lsh_index(lsh_index *l)
+{
+    size_t buckets = (size_t)l->tables << l->bits;
+    for (size_t i = 0; i < buckets; i++) free(l->items[i]);
+    free(l->items);
+    free(l->count);
+    free(l->cap);
+    free(l->pos);
+    free(l->d);
+    free(l);
+}
+
+// Hash key of a descriptor in one table.
+static unsigned lsh_key(lsh_index *l, const binary_descriptor *d, int t)
+{
+    unsigned key = 0;
+    const int *pos = l->pos + t*l->bits;
+    for (int b = 0; b < l->bits; b++) {
+        key |= ((d->bits[pos[b]/64] >> (pos[b]%64)) & 1ULL) << b;
+    }
+    return key;
+}
+
+// Insert descriptors into an index, after the ones already there.
+// lsh_index *l: index to grow.
+// binary_descriptor *d: descriptors to add.
+// int n: number of descriptors.
+void lsh_index_insert(lsh_index *l, binary_descriptor *d, int n)
+{
+    if (l->n + n > l->size) {
+        l->size = MAX(2*l->size, l->n + n);
+        l->d = realloc(l->d, l->size*sizeof(binary_descriptor));
+    }
+    memcpy(l->d + l->n, d, n*sizeof(binary_descriptor));
+    for (int i = l->n; i < l->n + n; i++) {
+        for (int t = 0; t < l->tables; t++) {
+            size_t b = ((size_t)t << l->bits) + lsh_key(l, l->d + i, t);
+            if (l->count[b] == l->cap[b]) {
+                l->cap[b] = l->cap[b] ? 2*l->cap[b] : 4;
+                l->items[b] = realloc(l->items[b], l->cap[b]*sizeof(int));
+            }
+            l->items[b][l->count[b]++] = i;
+        }
+    }
+    l->n += n;
+}
+
+// Number of descriptors in an index.
+int lsh_index_size(lsh_index *l)
+{
+    return l->n;
+}
+
+// Keypoint of a descriptor in an index.
+// int i: index in insertion order.
+point lsh_index_point(lsh_index *l, int i)
+{
+    return l->d[i].p;
+}
+
+// Find approximate nearest and second nearest neighbours in an index.
+// lsh_index *l: index to search.
+// binary_descriptor *q: query descriptors.
+// int n: number of queries.
+// int probes: extra buckets to probe per table, each one flips a single
+//             key bit. The recall/speed knob, 0 to l->bits.
+// returns: n results, indices are in index insertion order.
+knn2 *lsh_index_knn2(lsh_index *l, binary_descriptor *q, int n, int probes)
+{
+    knn2 *r = calloc(n + 1, sizeof(knn2));
+    probes = MIN(MAX(probes, 0), l->bits);
+    #pragma omp parallel
+    {
+        int *seen = calloc(l->n + 1, sizeof(int));
+        #pragma omp for schedule(dynamic, 16)
+        for (int j = 0; j < n; j++) {
+            knn2 k = {-1, -1, FLT_MAX, FLT_MAX};
+            for (int t = 0; t < l->tables; t++) {
+                unsigned key = lsh_key(l, q + j, t);
+                for (int p = -1; p < probes; p++) {
+                    size_t b = ((size_t)t << l->bits) + (p < 0 ? key : key ^ (1u << p));
+                    for (int i = 0; i < l->count[b]; i++) {
+                        int item = l->items[b][i];
+                        if (seen[item] == j + 1) continue;
+                        seen[item] = j + 1;
+                        float d = hamming_distance(q + j, l->d + item);
+                        if (d < k.d2) knn2_update(&k, item, d);
+                    }
+                }
+            }
+            r[j] = k;
+        }
+        free(seen);
+    }
+    return r;
+}
+
+// Match binary descriptors against an index.
+// binary_descriptor *a: query descriptors.
+// int an: number of queries.
+// lsh_index *l: index to search.
+// int probes: recall/speed knob, see lsh_index_knn2.
+// int *mn: pointer to number of matches found, filled in.
+// returns: matches, one-to-one, sorted by distance. bi indexes the index.
+match *match_lsh_index(binary_descriptor *a, int an, lsh_index *l, int probes, int *mn)
+{
+    knn2 *k = lsh_index_knn2(l, a, an, probes);
+    match *m = calloc(an + 1, sizeof(match));
+    int n = 0;
+    for (int j = 0; j < an; j++) {
+        if (k[j].best < 0) continue;
+        m[n].ai = j;
+        m[n].bi = k[j].best;
+        m[n].p = a[j].p;
+        m[n].q = lsh_index_point(l, k[j].best);
+        m[n].distance = k[j].d1;
+        ++n;
+    }
+    free(k);
+    *mn = n ? unique_matches(m, n, l->n) : 0;
+    return m;
+}
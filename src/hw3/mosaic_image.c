@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <float.h>
+#include "image.h"
+#include "matrix.h"
+
+// Swap the roles of the two images in a set of matches.
+// match *m: matches, modified in place.
+// int n: number of matches.
+static void flip_matches(match *m, int n)
+{
+    for (int i = 0; i < n; i++) {
+        point t = m[i].p;
+        m[i].p = m[i].q;
+        m[i].q = t;
+        int ti = m[i].ai;
+        m[i].ai = m[i].bi;
+        m[i].bi = ti;
+    }
+}
+
+// Images ahead in input order each image is matched with. Panoramas are
+// shot in sequence, so overlapping images are near each other in order.
+#define MOSAIC_NEIGHBOURS 2
+
+// Find homographies that bring every image into the frame of a reference
+// image. Only candidate pairs are matched, each image with the next
+// MOSAIC_NEIGHBOURS images in input order, so matching cost is linear in
+// the number of images. Images are added one at a time, always the
+// unplaced image with the most ratio-test matches to an already placed
+// one, and each pair is verified with RANSAC before its homography is
+// chained on. A pair is accepted with the test from Brown and Lowe,
+// "Automatic Panoramic Image Stitching using Invariant Features",
+// inliers > 8 + .2*matches, a little looser than theirs since ratio-tested
+// matches have fewer outliers.
+// descriptor_set *s: features of each image, detected once.
+// int n: number of images, in capture order.
+// int ref: index of the reference image.
+// float inlier_thresh: threshold for RANSAC inliers.
+// int iters: number of RANSAC iterations.
+// int cutoff: RANSAC inlier cutoff.
+// homography *H: n homographies from each image to the reference, filled in.
+// int *order: filled with the indexes of the placed images in the order
+//             they were added, order[0] = ref.
+// returns: number of images placed.
+int panorama_homographies(descriptor_set *s, int n, int ref, float inlier_thresh, int iters, int cutoff, homography *H, int *order)
+{
+    assert(ref >= 0 && ref < n);
+    const int w = MOSAIC_NEIGHBOURS;
+    // Pair k = i*w + d - 1 is image i with image i + d, p in i and q in i + d.
+    match **m = calloc(n*w, sizeof(match *));
+    int *mn = calloc(n*w, sizeof(int));
+    int *placed = calloc(n, sizeof(int));
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int k = 0; k < n*w; k++) {
+        int i = k/w, j = i + k%w + 1;
+        if (j >= n) continue;
+        m[k] = match_descriptor_set_ratio(s[i], s[j], .8, 0, &mn[k]);
+    }
+
+    for (int i = 0; i < n; i++) H[i] = identity_homography();
+    placed[ref] = 1;
+    order[0] = ref;
+    int count = 1;
+
+    while (count < n) {
+        // Strongest untried pair between a placed and an unplaced image.
+        int bk = -1, best = 0;
+        for (int k = 0; k < n*w; k++) {
+            int i = k/w, j = i + k%w + 1;
+            if (j >= n || placed[i] == placed[j] || mn[k] <= best) continue;
+            best = mn[k];
+            bk = k;
+        }
+        if (bk < 0) break;
+
+        int i = bk/w, j = i + bk%w + 1;
+        // bi is placed, bj is new. Matches go from the new image to bi.
+        int bi = placed[i] ? i : j, bj = placed[i] ? j : i;
+        if (bi < bj) flip_matches(m[bk], mn[bk]);
+        matrix Hji = RANSAC_prosac(m[bk], mn[bk], inlier_thresh, iters, cutoff, 10);
+        int inliers = Hji.data ? model_inliers(Hji, m[bk], mn[bk], inlier_thresh) : 0;
+        if (inliers > 8 + .2*mn[bk]) {
+            H[bj] = homography_mult(H[bi], matrix_to_homography(Hji));
+            placed[bj] = 1;
+            order[count++] = bj;
+        }
+        // Either way this pair is used up.
+        mn[bk] = 0;
+        free_matrix(Hji);
+    }
+
+    for (int k = 0; k < n*w; k++) free(m[k]);
+    free(m);
+    free(mn);
+    free(placed);
+    return count;
+}
+
+// Render placed images onto one canvas in the reference frame. Every
+// canvas pixel is computed once, from the first image in order that
+// covers it, so earlier images in order are on top. Images whose
+// homography can't be inverted are left out.
+// image *ims: the images.
+// int n: number of images.
+// homography *H: homographies from each image to the reference.
+// const int *order: indexes of the images to draw, by priority.
+// int placed: number of entries in order.
+// returns: the stitched canvas.
+image render_panorama(image *ims, int n, homography *H, const int *order, int placed)
+{
+    assert(placed > 0);
+    int c = ims[order[0]].c;
+    int *use = calloc(placed, sizeof(int));
+    homography *inv = calloc(placed, sizeof(homography));
+    float *box = calloc(4*placed, sizeof(float));
+    float x0 = FLT_MAX, y0 = FLT_MAX, x1 = -FLT_MAX, y1 = -FLT_MAX;
+
+    // Images that can be drawn, in order, and their bounds on the canvas.
+    int kept = 0;
+    for (int t = 0; t < placed; t++) {
+        image im = ims[order[t]];
+        int ok = 0;
+        homography hinv = homography_invert(H[order[t]], &ok);
+        if (!ok) {
+            fprintf(stderr, "render_panorama: singular homography, skipping image %d\n", order[t]);
+            if (t == 0) break;
+            continue;
+        }
+        use[kept] = order[t];
+        inv[kept] = hinv;
+        point corners[4] = {make_point(0, 0), make_point(im.w-1, 0),
+                            make_point(0, im.h-1), make_point(im.w-1, im.h-1)};
+        float *b = box + 4*kept;
+        b[0] = b[1] = FLT_MAX;
+        b[2] = b[3] = -FLT_MAX;
+        for (int i = 0; i < 4; i++) {
+            point p = project_point_h(H[use[kept]], corners[i]);
+            b[0] = MIN(b[0], p.x); b[1] = MIN(b[1], p.y);
+            b[2] = MAX(b[2], p.x); b[3] = MAX(b[3], p.y);
+        }
+        x0 = MIN(x0, b[0]); y0 = MIN(y0, b[1]);
+        x1 = MAX(x1, b[2]); y1 = MAX(y1, b[3]);
+        kept++;
+    }
+
+    // Nothing left to stitch onto the reference.
+    if (kept < placed && kept <= 1) {
+        free(use);
+        free(inv);
+        free(box);
+        return copy_image(ims[order[0]]);
+    }
+
+    int dx = floorf(x0);
+    int dy = floorf(y0);
+    int w = ceilf(x1) - dx + 1;
+    int h = ceilf(y1) - dy + 1;
+
+    // Same limit as combine_images, usually means a homography was bad.
+    if (w > 7000 || h > 7000) {
+        fprintf(stderr, "output too big, stopping\n");
+        free(use);
+        free(inv);
+        free(box);
+        return copy_image(ims[order[0]]);
+    }
+
+    image out = make_image(w, h, c);
+    #pragma omp parallel
+    {
+        float *v = calloc(c, sizeof(float));
+        #pragma omp for schedule(dynamic, 8)
+        for (int j = 0; j < h; j++) {
+            float y = j + dy;
+            for (int i = 0; i < w; i++) {
+                float x = i + dx;
+                for (int t = 0; t < kept; t++) {
+                    const float *b = box + 4*t;
+                    if (x < b[0] || x > b[2] || y < b[1] || y > b[3]) continue;
+                    image im = ims[use[t]];
+                    point p = project_point_h(inv[t], make_point(x, y));
+                    if (!(p.x >= 0 && p.y >= 0 && p.x <= im.w - 1 && p.y <= im.h - 1)) continue;
+                    bilinear_sample(im, p.x, p.y, v);
+                    for (int k = 0; k < MIN(c, im.c); k++) out.data[(k*h + j)*w + i] = v[k];
+                    break;
+                }
+            }
+        }
+        free(v);
+    }
+    free(use);
+    free(inv);
+    free(box);
+    return out;
+}
+
+// Stitch any number of images into one panorama. Features are detected
+// once per image, pairs are verified only as needed to connect every image
+// to the reference, and the canvas is rendered in a single warp pass.
+// image *ims: images to stitch.
+// int n: number of images.
+// int ref: index of the image whose frame the panorama is in.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// float inlier_thresh: threshold for RANSAC inliers. Typical: 2-5
+// int iters: number of RANSAC iterations. Typical: 1,000-50,000
+// int cutoff: RANSAC inlier cutoff. Typical: 10-100
+// returns: panorama of all the images that could be connected to ref.
+image panorama_images(image *ims, int n, int ref, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff)
+{
+    descriptor_set *s = calloc(n, sizeof(descriptor_set));
+    homography *H = calloc(n, sizeof(homography));
+    int *order = calloc(n, sizeof(int));
+
+    for (int i = 0; i < n; i++) s[i] = harris_corner_detector_set(ims[i], sigma, thresh, nms);
+    int placed = panorama_homographies(s, n, ref, inlier_thresh, iters, cutoff, H, order);
+    if (placed < n) fprintf(stderr, "panorama: placed %d of %d images\n", placed, n);
+    image pan = render_panorama(ims, n, H, order, placed);
+
+    for (int i = 0; i < n; i++) free_descriptor_set(s[i]);
+    free(s);
+    free(H);
+    free(order);
+    return pan;
+}
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <assert.h>
 #include "image.h"
 #include "matrix.h"
@@ -97,8 +98,8 @@ image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms
     int an = 0;
     int bn = 0;
     int mn = 0;
-    descriptor *ad = harris_corner_detector(a, sigma, thresh, nms, &an);
-    descriptor *bd = harris_corner_detector(b, sigma, thresh, nms, &bn);
+    descriptor *ad = harris_corner_detector_cached(a, sigma, thresh, nms, &an);
+    descriptor *bd = harris_corner_detector_cached(b, sigma, thresh, nms, &bn);
     match *m = match_descriptors(ad, an, bd, bn, &mn);
 
     mark_corners(a, ad, an);
@@ -125,6 +126,34 @@ float l1_distance(float *a, float *b, int n)
     return sum;
 }
 
+// Makes matches injective (one-to-one).
+// match *m: matches, at most one per descriptor in a.
+// int n: number of matches.
+// int bn: number of descriptors in b.
+// returns: number of unique matches, moved to the front of m and sorted by
+//          distance.
+int unique_matches(match *m, int n, int bn)
+{
+    int i;
+    int count = 0;
+    int *seen = calloc(bn, sizeof(int));
+    // TODO: we want matches to be injective (one-to-one).
+    // Sort matches based on distance using match_compare and qsort.
+    // Then throw out matches to the same element in b. Use seen to keep track.
+    // Each point should only be a part of one match.
+    // Some points will not be in a match.
+    // In practice just bring good matches to front of list, return count.
+    qsort(m, n, sizeof(match), match_compare);
+    for (i = 0; i < n; i++) {
+        if (!seen[m[i].bi]) {
+            seen[m[i].bi] = 1;
+            m[count++] = m[i];
+        }
+    }
+    free(seen);
+    return count;
+}
+
 // Finds best matches between descriptors of two images.
 // descriptor *a, *b: array of descriptors for pixels in two images.
 // int an, bn: number of descriptors in arrays a and b.
@@ -156,23 +185,31 @@ match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
         m[j].q = b[bind].p;
         m[j].distance = min_bind; // <- should be the smallest L1 distance!
     }
-    int count = 0;
-    int *seen = calloc(bn, sizeof(int));
-    // TODO: we want matches to be injective (one-to-one).
-    // Sort matches based on distance using match_compare and qsort.
-    // Then throw out matches to the same element in b. Use seen to keep track.
-    // Each point should only be a part of one match.
-    // Some points will not be in a match.
-    // In practice just bring good matches to front of list, set *mn.
-    qsort(m, an, sizeof(match), match_compare);
-    for (i = 0; i < an; i++) {
-        if (!seen[m[i].bi]) {
-            seen[m[i].bi] = 1;
-            m[count++] = m[i];
-        }
+    *mn = unique_matches(m, an, bn);
+    return m;
+}
+
+// Finds best matches between two descriptor sets.
+// descriptor_set a, b: descriptors for pixels in two images.
+// int *mn: pointer to number of matches found, to be filled in by function.
+// returns: best matches found, one-to-one, sorted by distance.
+match *match_descriptor_set(descriptor_set a, descriptor_set b, int *mn)
+{
+    match *m = calloc(a.n + 1, sizeof(match));
+    if (!b.n) {
+        *mn = 0;
+        return m;
     }
-    *mn = count;
-    free(seen);
+    knn2 *k = knn2_descriptor_set(a, b);
+    for (int j = 0; j < a.n; j++) {
+        m[j].ai = j;
+        m[j].bi = k[j].best;
+        m[j].p = make_point(a.x[j], a.y[j]);
+        m[j].q = make_point(b.x[k[j].best], b.y[k[j].best]);
+        m[j].distance = k[j].d1;
+    }
+    free(k);
+    *mn = unique_matches(m, a.n, b.n);
     return m;
 }
 
@@ -182,19 +219,110 @@ match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
 // returns: point projected using the homography.
 point project_point(matrix H, point p)
 {
-    matrix c = make_matrix(3, 1);
     // TODO: project point p with homography H.
     // Remember that homogeneous coordinates are equivalent up to scalar.
     // Have to divide by.... something...
-    c.data[0][0] = p.x;
-    c.data[1][0] = p.y;
-    c.data[2][0] = 1;
-    matrix p_prime = matrix_mult_matrix(H, c);
-
-    point q = make_point(p_prime.data[0][0]/p_prime.data[2][0], p_prime.data[1][0]/p_prime.data[2][0]);
-    free_matrix(c);
-    free_matrix(p_prime);
-    return q;
+    double x = H.data[0][0]*p.x + H.data[0][1]*p.y + H.data[0][2];
+    double y = H.data[1][0]*p.x + H.data[1][1]*p.y + H.data[1][2];
+    double w = H.data[2][0]*p.x + H.data[2][1]*p.y + H.data[2][2];
+    return make_point(x/w, y/w);
+}
+
+// Convert a 3x3 matrix to a fixed-size homography.
+// matrix H: 3x3 matrix.
+// returns: homography with the same values.
+homography matrix_to_homography(matrix H)
+{
+    assert(H.rows == 3 && H.cols == 3);
+    homography h;
+    int i, j;
+    for(i = 0; i < 3; ++i){
+        for(j = 0; j < 3; ++j){
+            h.h[3*i + j] = H.data[i][j];
+        }
+    }
+    return h;
+}
+
+// Convert a fixed-size homography to a 3x3 matrix.
+// homography h: homography to convert.
+// returns: newly allocated 3x3 matrix.
+matrix homography_to_matrix(homography h)
+{
+    matrix H = make_matrix(3, 3);
+    int i, j;
+    for(i = 0; i < 3; ++i){
+        for(j = 0; j < 3; ++j){
+            H.data[i][j] = h.h[3*i + j];
+        }
+    }
+    return H;
+}
+
+homography identity_homography()
+{
+    homography h = {{1, 0, 0, 0, 1, 0, 0, 0, 1}};
+    return h;
+}
+
+// Multiply two homographies.
+// homography a, b: homographies, b is applied first.
+// returns: a*b.
+homography homography_mult(homography a, homography b)
+{
+    homography c;
+    int i, j;
+    for(i = 0; i < 3; ++i){
+        for(j = 0; j < 3; ++j){
+            c.h[3*i + j] = a.h[3*i]*b.h[j] + a.h[3*i + 1]*b.h[3 + j] + a.h[3*i + 2]*b.h[6 + j];
+        }
+    }
+    return c;
+}
+
+// Invert a homography with its adjugate.
+// homography a: homography to invert.
+// int *ok: set to 0 if a is singular, may be null.
+// returns: inverse of a, scaled so the bottom right value is 1 when possible.
+homography homography_invert(homography a, int *ok)
+{
+    const double *m = a.h;
+    homography r;
+    r.h[0] = m[4]*m[8] - m[5]*m[7];
+    r.h[1] = m[2]*m[7] - m[1]*m[8];
+    r.h[2] = m[1]*m[5] - m[2]*m[4];
+    r.h[3] = m[5]*m[6] - m[3]*m[8];
+    r.h[4] = m[0]*m[8] - m[2]*m[6];
+    r.h[5] = m[2]*m[3] - m[0]*m[5];
+    r.h[6] = m[3]*m[7] - m[4]*m[6];
+    r.h[7] = m[1]*m[6] - m[0]*m[7];
+    r.h[8] = m[0]*m[4] - m[1]*m[3];
+    double det = m[0]*r.h[0] + m[1]*r.h[3] + m[2]*r.h[6];
+    if (ok) *ok = det != 0;
+    if (det == 0) return r;
+    double s = r.h[8] != 0 ? 1/r.h[8] : 1/det;
+    int i;
+    for(i = 0; i < 9; ++i) r.h[i] *= s;
+    return r;
+}
+
+// Project an array of points with a homography.
+// homography h: homography to project with.
+// const point *in: points to project.
+// point *out: projected points, may be the same array as in.
+// int n: number of points.
+void project_points(homography h, const point *in, point *out, int n)
+{
+    const float h0 = h.h[0], h1 = h.h[1], h2 = h.h[2];
+    const float h3 = h.h[3], h4 = h.h[4], h5 = h.h[5];
+    const float h6 = h.h[6], h7 = h.h[7], h8 = h.h[8];
+    int i;
+    for(i = 0; i < n; ++i){
+        float x = in[i].x, y = in[i].y;
+        float w = 1.f/(h6*x + h7*y + h8);
+        out[i].x = (h0*x + h1*y + h2)*w;
+        out[i].y = (h3*x + h4*y + h5)*w;
+    }
 }
 
 // Calculate L2 distance between two points.
@@ -216,6 +344,17 @@ float point_distance(point p, point q)
 //          their match in the other image. Should also rearrange matches
 //          so that the inliers are first in the array. For drawing.
 int model_inliers(matrix H, match *m, int n, float thresh)
+{
+    return homography_inliers(matrix_to_homography(H), m, n, thresh);
+}
+
+// Same as model_inliers for a fixed-size homography.
+// homography h: homography between coordinate systems.
+// match *m: matches to compute inlier/outlier, inliers are moved first.
+// int n: number of matches in m.
+// float thresh: threshold to be an inlier.
+// returns: number of inliers.
+int homography_inliers(homography h, match *m, int n, float thresh)
 {
     int i;
     int count = 0;
@@ -223,7 +362,7 @@ int model_inliers(matrix H, match *m, int n, float thresh)
     // i.e. distance(H*p, q) < thresh
     // Also, sort the matches m so the inliers are the first 'count' elements.
     for (i = 0; i < n; i++) {
-        if (point_distance(project_point(H, m[i].p), m[i].q) < thresh) {
+        if (point_distance(project_point_h(h, m[i].p), m[i].q) < thresh) {
             match tmp = m[count];
             m[count++] = m[i];
             m[i] = tmp;
@@ -246,57 +385,182 @@ void randomize_matches(match *m, int n)
     }
 }
 
+// Find the similarity transform that moves points to their centroid and
+// scales them to mean distance sqrt(2) from it (Hartley normalization).
+// const match *m: matches.
+// int n: number of matches.
+// int second: 0 to normalize the p points, 1 for the q points.
+// double T[3]: filled with {s, tx, ty}, x' = s*x + tx, y' = s*y + ty.
+static void normalize_points(const match *m, int n, int second, double T[3])
+{
+    double cx = 0, cy = 0, d = 0;
+    int i;
+    for(i = 0; i < n; ++i){
+        point p = second ? m[i].q : m[i].p;
+        cx += p.x; cy += p.y;
+    }
+    cx /= n; cy /= n;
+    for(i = 0; i < n; ++i){
+        point p = second ? m[i].q : m[i].p;
+        d += sqrt((p.x - cx)*(p.x - cx) + (p.y - cy)*(p.y - cy));
+    }
+    d /= n;
+    T[0] = d > 0 ? sqrt(2)/d : 1;
+    T[1] = -T[0]*cx;
+    T[2] = -T[0]*cy;
+}
+
+// Fill the two rows of the homography system for one normalized match.
+// const match *m: the match.
+// double Tp[3], Tq[3]: normalizing transforms.
+// double r0[9], r1[9]: rows, 8 coefficients then the right hand side.
+static void homography_rows(const match *m, const double Tp[3], const double Tq[3], double r0[9], double r1[9])
+{
+    double x  = Tp[0]*m->p.x + Tp[1];
+    double y  = Tp[0]*m->p.y + Tp[2];
+    double xp = Tq[0]*m->q.x + Tq[1];
+    double yp = Tq[0]*m->q.y + Tq[2];
+    r0[0] = x; r0[1] = y; r0[2] = 1; r0[3] = 0; r0[4] = 0; r0[5] = 0;
+    r0[6] = -x*xp; r0[7] = -y*xp; r0[8] = xp;
+    r1[0] = 0; r1[1] = 0; r1[2] = 0; r1[3] = x; r1[4] = y; r1[5] = 1;
+    r1[6] = -x*yp; r1[7] = -y*yp; r1[8] = yp;
+}
+
+// Undo the normalization of a solved homography, H = Tq^-1 * Hn * Tp.
+// const double a[8]: solution in normalized coordinates, h33 = 1.
+// double Tp[3], Tq[3]: normalizing transforms.
+// homography *H: filled with the homography, scaled so h33 = 1.
+// returns: 1 on success, 0 if the result is degenerate.
+static int denormalize_homography(const double a[8], const double Tp[3], const double Tq[3], homography *H)
+{
+    homography n = {{a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], 1}};
+    homography tp = {{Tp[0], 0, Tp[1], 0, Tp[0], Tp[2], 0, 0, 1}};
+    homography tqi = {{1/Tq[0], 0, -Tq[1]/Tq[0], 0, 1/Tq[0], -Tq[2]/Tq[0], 0, 0, 1}};
+    homography h = homography_mult(tqi, homography_mult(n, tp));
+    if (fabs(h.h[8]) < 1e-12) return 0;
+    int i;
+    for(i = 0; i < 9; ++i) h.h[i] /= h.h[8];
+    *H = h;
+    return 1;
+}
+
+// Check if any three of four normalized points are (nearly) collinear.
+// const match *m: 4 matches.
+// int second: 0 to check the p points, 1 for the q points.
+// double T[3]: normalizing transform for those points.
+// returns: 1 if the points can't determine a homography.
+static int degenerate_4(const match *m, int second, const double T[3])
+{
+    double x[4], y[4];
+    int i;
+    for(i = 0; i < 4; ++i){
+        point p = second ? m[i].q : m[i].p;
+        x[i] = T[0]*p.x + T[1];
+        y[i] = T[0]*p.y + T[2];
+    }
+    for(i = 0; i < 4; ++i){
+        int a = (i + 1)%4, b = (i + 2)%4, c = (i + 3)%4;
+        double cross = (x[b] - x[a])*(y[c] - y[a]) - (y[b] - y[a])*(x[c] - x[a]);
+        if(fabs(cross) < 1e-6) return 1;
+    }
+    return 0;
+}
+
+// Compute a homography from exactly 4 matches, the minimal RANSAC sample.
+// Hartley-normalized DLT solved by Gaussian elimination with partial
+// pivoting on an 8x8 system on the stack, nothing is allocated.
+// const match *m: 4 matches.
+// homography *H: filled with the homography from p to q.
+// returns: 1 on success, 0 if the matches are degenerate.
+int homography_from_4(const match *m, homography *H)
+{
+    double Tp[3], Tq[3];
+    double A[8][9];
+    int i, j, k;
+    normalize_points(m, 4, 0, Tp);
+    normalize_points(m, 4, 1, Tq);
+    if(degenerate_4(m, 0, Tp) || degenerate_4(m, 1, Tq)) return 0;
+    for(i = 0; i < 4; ++i) homography_rows(m + i, Tp, Tq, A[2*i], A[2*i + 1]);
+    for(k = 0; k < 8; ++k){
+        int piv = k;
+        for(i = k + 1; i < 8; ++i) if(fabs(A[i][k]) > fabs(A[piv][k])) piv = i;
+        if(fabs(A[piv][k]) < 1e-10) return 0;
+        if(piv != k){
+            for(j = k; j < 9; ++j){ double t = A[k][j]; A[k][j] = A[piv][j]; A[piv][j] = t; }
+        }
+        for(i = k + 1; i < 8; ++i){
+            double f = A[i][k]/A[k][k];
+            for(j = k; j < 9; ++j) A[i][j] -= f*A[k][j];
+        }
+    }
+    double a[8];
+    for(k = 7; k >= 0; --k){
+        double sum = A[k][8];
+        for(j = k + 1; j < 8; ++j) sum -= A[k][j]*a[j];
+        a[k] = sum/A[k][k];
+    }
+    return denormalize_homography(a, Tp, Tq, H);
+}
+
+// Least-squares homography from any number of matches, e.g. all the
+// inliers of a RANSAC model. Rows of the normalized DLT system are folded
+// one by one into an 8x8 triangular factor with Givens rotations (QR), so
+// the normal equations are never formed and nothing is allocated.
+// const match *m: matches.
+// int n: number of matches, at least 4.
+// homography *H: filled with the homography from p to q.
+// returns: 1 on success, 0 if the matches are degenerate.
+int homography_least_squares(const match *m, int n, homography *H)
+{
+    if (n < 4) return 0;
+    double Tp[3], Tq[3];
+    double R[8][9] = {{0}};
+    double rows[2][9];
+    int i, j, k, r;
+    normalize_points(m, n, 0, Tp);
+    normalize_points(m, n, 1, Tq);
+    for(i = 0; i < n; ++i){
+        homography_rows(m + i, Tp, Tq, rows[0], rows[1]);
+        for(r = 0; r < 2; ++r){
+            double *row = rows[r];
+            for(k = 0; k < 8; ++k){
+                if(row[k] == 0) continue;
+                double a = R[k][k], b = row[k];
+                double h = hypot(a, b);
+                double c = a/h, s = b/h;
+                for(j = k; j < 9; ++j){
+                    double t = c*R[k][j] + s*row[j];
+                    row[j] = -s*R[k][j] + c*row[j];
+                    R[k][j] = t;
+                }
+            }
+        }
+    }
+    double a[8];
+    for(k = 7; k >= 0; --k){
+        if(fabs(R[k][k]) < 1e-10) return 0;
+        double sum = R[k][8];
+        for(j = k + 1; j < 8; ++j) sum -= R[k][j]*a[j];
+        a[k] = sum/R[k][k];
+    }
+    return denormalize_homography(a, Tp, Tq, H);
+}
+
 // Computes homography between two images given matching pixels.
 // match *matches: matching points between images.
 // int n: number of matches to use in calculating homography.
 // returns: matrix representing homography H that maps image a to image b.
 matrix compute_homography(match *matches, int n)
 {
-    matrix M = make_matrix(n*2, 8);
-    matrix b = make_matrix(n*2, 1);
-
-    int i;
-    for(i = 0; i < n; ++i){
-        double x  = matches[i].p.x;
-        double xp = matches[i].q.x;
-        double y  = matches[i].p.y;
-        double yp = matches[i].q.y;
-        // TODO: fill in the matrices M and b.
-        M.data[2 * i][0] = x;
-        M.data[2 * i][1] = y;
-        M.data[2 * i][2] = 1;
-        M.data[2 * i][6] = -x * xp;
-        M.data[2 * i][7] = -y * xp;
-        M.data[2 * i + 1][3] = x;
-        M.data[2 * i + 1][4] = y;
-        M.data[2 * i + 1][5] = 1;
-        M.data[2 * i + 1][6] = -x * yp;
-        M.data[2 * i + 1][7] = -y * yp;
-
-        b.data[2 * i][0] = xp;
-        b.data[2 * i + 1][0] = yp;
-    }
-    matrix a = solve_system(M, b);
-    free_matrix(M); free_matrix(b); 
+    // The minimal case gets the direct solver, anything bigger a QR
+    // least-squares fit. Both work on Hartley-normalized points.
+    homography h;
+    int ok = n == 4 ? homography_from_4(matches, &h) : homography_least_squares(matches, n, &h);
 
     // If a solution can't be found, return empty matrix;
     matrix none = {0};
-    if(!a.data) return none;
-
-    matrix H = make_matrix(3, 3);
-    // TODO: fill in the homography H based on the result in a.
-    H.data[0][0] = a.data[0][0];
-    H.data[0][1] = a.data[1][0];
-    H.data[0][2] = a.data[2][0];
-    H.data[1][0] = a.data[3][0];
-    H.data[1][1] = a.data[4][0];
-    H.data[1][2] = a.data[5][0];
-    H.data[2][0] = a.data[6][0];
-    H.data[2][1] = a.data[7][0];
-    H.data[2][2] = 1;
-
-    free_matrix(a);
-    return H;
+    if(!ok) return none;
+    return homography_to_matrix(h);
 }
 
 // Perform RANdom SAmple Consensus to calculate homography for noisy matches.
@@ -308,9 +572,10 @@ matrix compute_homography(match *matches, int n)
 // returns: matrix representing most common homography between matches.
 matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
 {
-    int e = 4;
     int best = 0;
-    matrix Hb;
+    homography Hb;
+    matrix none = {0};
+    if (n < 4) return none;
     // TODO: fill in RANSAC algorithm.
     // for k iterations:
     //     shuffle the matches
@@ -322,22 +587,20 @@ matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
     //             return it immediately
     // if we get to the end return the best homography
     for (int i = 0; i < k; i++) {
+        homography H;
         randomize_matches(m, n);
-        matrix H = compute_homography(m, e);
-        if (!H.data) continue;
+        if (!homography_from_4(m, &H)) continue;
 
-        int inliers = model_inliers(H, m, n, thresh);
+        int inliers = homography_inliers(H, m, n, thresh);
         if (inliers > best) {
+            homography refit;
+            if (!homography_least_squares(m, inliers, &refit)) continue;
             best = inliers;
-            Hb = compute_homography(m, inliers);
-            if (inliers > cutoff) {
-                free_matrix(H);
-                return Hb;
-            }
+            Hb = refit;
+            if (inliers > cutoff) break;
         }
-        free_matrix(H);
     }
-    return Hb;
+    return best ? homography_to_matrix(Hb) : none;
 }
 
 // Stitches two images together using a projective transformation.
@@ -346,13 +609,20 @@ matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
 // returns: combined image stitched together.
 image combine_images(image a, image b, matrix H)
 {
-    matrix Hinv = matrix_invert(H);
+    int ok = 0;
+    homography Hh = matrix_to_homography(H);
+    homography Hinv = homography_invert(Hh, &ok);
+    // A singular H can't place b, keep just a.
+    if (!ok) {
+        fprintf(stderr, "singular homography, not combining\n");
+        return copy_image(a);
+    }
 
     // Project the corners of image b into image a coordinates.
-    point c1 = project_point(Hinv, make_point(0,0));
-    point c2 = project_point(Hinv, make_point(b.w-1, 0));
-    point c3 = project_point(Hinv, make_point(0, b.h-1));
-    point c4 = project_point(Hinv, make_point(b.w-1, b.h-1));
+    point c1 = project_point_h(Hinv, make_point(0,0));
+    point c2 = project_point_h(Hinv, make_point(b.w-1, 0));
+    point c3 = project_point_h(Hinv, make_point(0, b.h-1));
+    point c4 = project_point_h(Hinv, make_point(b.w-1, b.h-1));
 
     // Find top left and bottom right corners of image b warped into image a.
     point topleft, botright;
@@ -364,8 +634,8 @@ image combine_images(image a, image b, matrix H)
     // Find how big our new image should be and the offsets from image a.
     int dx = MIN(0, topleft.x);
     int dy = MIN(0, topleft.y);
-    int w = MAX(a.w, botright.x) - dx;
-    int h = MAX(a.h, botright.y) - dy;
+    int w = MAX(a.w, floorf(botright.x) + 1) - dx;
+    int h = MAX(a.h, floorf(botright.y) + 1) - dy;
 
     // Can disable this if you are making very big panoramas.
     // Usually this means there was an error in calculating H.
@@ -374,35 +644,20 @@ image combine_images(image a, image b, matrix H)
         return copy_image(a);
     }
 
-    int i,j,k;
     image c = make_image(w, h, a.c);
-    
-    // Paste image a into the new image offset by dx and dy.
-    for(k = 0; k < a.c; ++k){
-        for(j = 0; j < a.h; ++j){
-            for(i = 0; i < a.w; ++i){
-                // TODO: fill in.
-                set_pixel(c, i - dx, j - dy, k, get_pixel(a, i, j, k));
-            }
-        }
-    }
 
-    // TODO: Paste in image b as well.
-    // You should loop over some points in the new image (which? all?)
-    // and see if their projection from a coordinates to b coordinates falls
-    // inside of the bounds of image b. If so, use bilinear interpolation to
-    // estimate the value of b at that projection, then fill in image c.
-    for(k = 0; k < a.c; ++k){
-        for(j = topleft.y; j < botright.y; ++j){
-            for(i = topleft.x; i < botright.x; ++i){
-                // TODO: fill in.
-                point p = project_point(H, make_point(i, j));
-                if (p.x >= 0 && p.y >= 0 && p.x < b.w && p.y < b.h) {
-                    set_pixel(c, i - dx, j - dy, k, bilinear_interpolate(b, p.x, p.y, k));
-                }
-            }
+    // Paste image a into the new image offset by dx and dy, a row at a time.
+    for(int k = 0; k < a.c; ++k){
+        for(int j = 0; j < a.h; ++j){
+            memcpy(c.data + (k*h + j - dy)*w - dx, a.data + (k*a.h + j)*a.w, a.w*sizeof(float));
         }
     }
+
+    // Paste in image b as well: every pixel in b's bounding box that
+    // projects inside b, all channels at once.
+    int x0 = topleft.x, y0 = topleft.y;
+    warp_homography_into(b, Hh, c, dx, dy, x0 - dx, y0 - dy,
+                         floorf(botright.x) + 1 - dx, floorf(botright.y) + 1 - dy);
     return c;
 }
 
@@ -416,20 +671,25 @@ image combine_images(image a, image b, matrix H)
 // int cutoff: RANSAC inlier cutoff. Typical: 10-100
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff)
 {
-    srand(10);
     int an = 0;
     int bn = 0;
     int mn = 0;
     
-    // Calculate corners and descriptors
-    descriptor *ad = harris_corner_detector(a, sigma, thresh, nms, &an);
-    descriptor *bd = harris_corner_detector(b, sigma, thresh, nms, &bn);
+    // Calculate corners and descriptors, the two images at once
+    descriptor *ad = 0, *bd = 0;
+    #pragma omp parallel sections
+    {
+        #pragma omp section
+        ad = harris_corner_detector_cached(a, sigma, thresh, nms, &an);
+        #pragma omp section
+        bd = harris_corner_detector_cached(b, sigma, thresh, nms, &bn);
+    }
 
     // Find matches
     match *m = match_descriptors(ad, an, bd, bn, &mn);
 
     // Run RANSAC to find the homography
-    matrix H = RANSAC(m, mn, inlier_thresh, iters, cutoff);
+    matrix H = RANSAC_parallel(m, mn, inlier_thresh, iters, cutoff, 10);
 
     if(0){
         // Mark corners and matches between images
@@ -443,18 +703,11 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
     free_descriptors(bd, bn);
     free(m);
 
+    // No homography, e.g. fewer than 4 matches.
+    if (!H.data) return copy_image(a);
+
     // Stitch the images together with the homography
     image comb = combine_images(a, b, H);
+    free_matrix(H);
     return comb;
 }
-
-// Project an image onto a cylinder.
-// image im: image to project.
-// float f: focal length used to take image (in pixels).
-// returns: image projected onto cylinder, then flattened.
-image cylindrical_project(image im, float f)
-{
-    //TODO: project image onto a cylinder
-    image c = copy_image(im);
-    return c;
-}
@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <time.h>
+#include "image.h"
+#include "matrix.h"
+
+static const char *pipeline_stage_names[PIPE_STAGES] = {"load", "detect", "match", "ransac", "warp"};
+
+// A node in a task graph. Tasks run once their dependencies finish.
+// void (*run)(void *ctx, int i): work to do, called with the graph's context.
+// int i: argument for run, usually an image index.
+// int stage: pipeline stage the task's time is counted under.
+// int dep[2]: tasks this one waits for, -1 for none. Always earlier tasks.
+typedef struct{
+    void (*run)(void *ctx, int i);
+    int i;
+    int stage;
+    int dep[2];
+} task;
+
+// Wall clock in seconds.
+static double wall_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Make task b wait for task a.
+static void task_depends(task *t, int b, int a)
+{
+    assert(a < b);
+    int j = t[b].dep[0] < 0 ? 0 : 1;
+    assert(t[b].dep[j] < 0);
+    t[b].dep[j] = a;
+}
+
+// Run a task graph as OpenMP tasks. One thread creates every task in
+// order with depend clauses on a token per task, and the runtime starts
+// each one when the tasks it waits for are done. Threads with nothing
+// ready block in the runtime instead of polling. Without OpenMP the tasks
+// run one at a time in order, which respects the dependencies since they
+// always point backwards.
+// Tasks run inside this parallel region, so parallel loops within them
+// run on a single thread: the concurrency comes from running tasks side
+// by side, not from splitting one.
+// task *t: tasks.
+// int n: number of tasks.
+// void *ctx: passed to every task.
+// double *stage: time spent in each stage, added to.
+static void run_task_graph(task *t, int n, void *ctx, double *stage)
+{
+    // token[n] is never written, depending on it waits for nothing.
+    char *token = calloc(n + 1, sizeof(char));
+    #pragma omp parallel
+    #pragma omp single
+    for (int k = 0; k < n; k++) {
+        #pragma omp task firstprivate(k) depend(out: token[k]) \
+                depend(in: token[t[k].dep[0] < 0 ? n : t[k].dep[0]], token[t[k].dep[1] < 0 ? n : t[k].dep[1]])
+        {
+            double start = wall_time();
+            t[k].run(ctx, t[k].i);
+            double took = wall_time() - start;
+            #pragma omp atomic
+            stage[t[k].stage] += took;
+        }
+    }
+    free(token);
+}
+
+// State shared by the tasks of a stitching pipeline.
+typedef struct{
+    char **paths;
+    int n;
+    float sigma, thresh;
+    int nms;
+    float inlier_thresh;
+    int iters, cutoff;
+    image *ims;
+    descriptor **d;
+    int *dn;
+    match **m;
+    int *mn;
+    homography *pair;  // pair[i]: image i to image i-1
+    int *ok;           // ok[i]: pair[i] passed verification
+    image pan;
+} stitch_pipeline;
+
+static void stitch_load(void *ctx, int i)
+{
+    stitch_pipeline *s = ctx;
+    s->ims[i] = load_image(s->paths[i]);
+}
+
+static void stitch_detect(void *ctx, int i)
+{
+    stitch_pipeline *s = ctx;
+    s->d[i] = harris_corner_detector_cached(s->ims[i], s->sigma, s->thresh, s->nms, &s->dn[i]);
+}
+
+static void stitch_match(void *ctx, int i)
+{
+    stitch_pipeline *s = ctx;
+    s->m[i] = match_descriptors_ratio(s->d[i], s->dn[i], s->d[i-1], s->dn[i-1], .8, 0, &s->mn[i]);
+}
+
+// Same acceptance test as panorama_homographies.
+static void stitch_ransac(void *ctx, int i)
+{
+    stitch_pipeline *s = ctx;
+    matrix H = RANSAC_prosac(s->m[i], s->mn[i], s->inlier_thresh, s->iters, s->cutoff, 10);
+    int inliers = H.data ? model_inliers(H, s->m[i], s->mn[i], s->inlier_thresh) : 0;
+    s->ok[i] = inliers > 8 + .2*s->mn[i];
+    if (s->ok[i]) s->pair[i] = matrix_to_homography(H);
+    free_matrix(H);
+}
+
+// Chain the pair homographies into the first image's frame and render.
+static void stitch_warp(void *ctx, int unused)
+{
+    stitch_pipeline *s = ctx;
+    homography *H = calloc(s->n, sizeof(homography));
+    int *order = calloc(s->n, sizeof(int));
+    int placed = 1;
+    H[0] = identity_homography();
+    while (placed < s->n && s->ok[placed]) {
+        H[placed] = homography_mult(H[placed-1], s->pair[placed]);
+        order[placed] = placed;
+        placed++;
+    }
+    if (placed < s->n) fprintf(stderr, "panorama: placed %d of %d images\n", placed, s->n);
+    s->pan = render_panorama(s->ims, s->n, H, order, placed);
+    free(H);
+    free(order);
+}
+
+// Stitch a sequence of image files, each overlapping the one before it,
+// into the frame of the first. The work is a task graph: every image is
+// loaded and detected on its own, consecutive pairs are matched and
+// verified as soon as both sides are ready, and one render pass runs at
+// the end. Independent tasks run at the same time, so the two detections
+// of a pair overlap and the next image decodes while the current pair is
+// matched. Each task itself runs on one thread. Images are placed up to
+// the first pair that fails to verify.
+// char **paths: image files, in order.
+// int n: number of images.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// float inlier_thresh: threshold for RANSAC inliers. Typical: 2-5
+// int iters: number of RANSAC iterations. Typical: 1,000-50,000
+// int cutoff: RANSAC inlier cutoff. Typical: 10-100
+// pipeline_times *times: filled with the time spent in each stage, may be 0.
+// returns: panorama of the images.
+image panorama_pipeline(char **paths, int n, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, pipeline_times *times)
+{
+    assert(n > 0);
+    double start = wall_time();
+    stitch_pipeline s = {0};
+    s.paths = paths;
+    s.n = n;
+    s.sigma = sigma;
+    s.thresh = thresh;
+    s.nms = nms;
+    s.inlier_thresh = inlier_thresh;
+    s.iters = iters;
+    s.cutoff = cutoff;
+    s.ims = calloc(n, sizeof(image));
+    s.d = calloc(n, sizeof(descriptor *));
+    s.dn = calloc(n, sizeof(int));
+    s.m = calloc(n, sizeof(match *));
+    s.mn = calloc(n, sizeof(int));
+    s.pair = calloc(n, sizeof(homography));
+    s.ok = calloc(n, sizeof(int));
+
+    // Tasks for image i: load, detect, then match and ransac against i-1.
+    int nt = 4*n - 2;
+    task *t = calloc(nt, sizeof(task));
+    for (int k = 0; k < nt; k++) t[k].dep[0] = t[k].dep[1] = -1;
+    int k = 0, prev_detect = -1;
+    for (int i = 0; i < n; i++) {
+        int load = k;
+        t[k].run = stitch_load; t[k].i = i; t[k++].stage = PIPE_LOAD;
+        int detect = k;
+        t[k].run = stitch_detect; t[k].i = i; t[k++].stage = PIPE_DETECT;
+        task_depends(t, detect, load);
+        if (i > 0) {
+            int match = k;
+            t[k].run = stitch_match; t[k].i = i; t[k++].stage = PIPE_MATCH;
+            task_depends(t, match, detect);
+            task_depends(t, match, prev_detect);
+            t[k].run = stitch_ransac; t[k].i = i; t[k++].stage = PIPE_RANSAC;
+            task_depends(t, k - 1, match);
+        }
+        prev_detect = detect;
+    }
+    assert(k == nt);
+
+    pipeline_times tm = {{0}};
+    run_task_graph(t, nt, &s, tm.stage);
+    // Rendering is one big parallel loop, run after the graph so it gets
+    // every thread.
+    double warp = wall_time();
+    stitch_warp(&s, 0);
+    tm.stage[PIPE_WARP] = wall_time() - warp;
+    tm.wall = wall_time() - start;
+    if (times) *times = tm;
+
+    for (int i = 0; i < n; i++) {
+        free_descriptors(s.d[i], s.dn[i]);
+        free(s.m[i]);
+        free_image(s.ims[i]);
+    }
+    free(s.ims);
+    free(s.d);
+    free(s.dn);
+    free(s.m);
+    free(s.mn);
+    free(s.pair);
+    free(s.ok);
+    free(t);
+    return s.pan;
+}
+
+// Print the time spent in each stage of a pipeline run. Stage times are
+// summed over tasks, so with several threads they can add up to more
+// than the wall time.
+// pipeline_times t: times from panorama_pipeline.
+void print_pipeline_times(pipeline_times t)
+{
+    for (int i = 0; i < PIPE_STAGES; i++) {
+        fprintf(stderr, "%-8s %8.3fs\n", pipeline_stage_names[i], t.stage[i]);
+    }
+    fprintf(stderr, "%-8s %8.3fs\n", "wall", t.wall);
+}
@@ -0,0 +1,404 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <float.h>
+#include "image.h"
+#include "matrix.h"
+
+// Hypotheses evaluated between checks of the inlier cutoff.
+#define RANSAC_BATCH 256
+
+// Counter-based random number: a stateless hash of (seed, counter), so any
+// hypothesis can draw its sample without sharing generator state.
+// unsigned seed: stream seed.
+// unsigned long long ctr: position in the stream.
+// returns: 32 pseudo-random bits.
+static unsigned ransac_random(unsigned seed, unsigned long long ctr)
+{
+    unsigned long long z = (seed + 0x9E3779B97F4A7C15ULL)*0xD1B54A32D192ED03ULL ^ ctr;
+    for (int r = 0; r < 2; r++) {
+        z += 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+    }
+    return z >> 32;
+}
+
+// Draw distinct indices for one hypothesis by rejection, the match array
+// itself is never touched. The hypothesis number picks the high half of
+// the counter and the draw the low half, so however many draws rejection
+// takes it never reads another hypothesis' stream.
+// unsigned seed: RANSAC seed.
+// int iter: hypothesis number.
+// int n: range to draw from, at least k.
+// int k: number of indices, at most 4.
+// int *idx: filled with the sample.
+static void sample_distinct(unsigned seed, int iter, int n, int k, int *idx)
+{
+    unsigned long long ctr = (unsigned long long)(unsigned)iter << 32;
+    int s = 0;
+    while (s < k) {
+        int r = ((unsigned long long)ransac_random(seed, ctr++) * n) >> 32;
+        int dup = 0;
+        for (int j = 0; j < s; j++) dup |= idx[j] == r;
+        if (!dup) idx[s++] = r;
+    }
+}
+
+// Draw 4 distinct match indices for one hypothesis.
+// unsigned seed: RANSAC seed.
+// int iter: hypothesis number.
+// int n: number of matches, at least 4.
+// int idx[4]: filled with the sample.
+void ransac_sample_4(unsigned seed, int iter, int n, int idx[4])
+{
+    sample_distinct(seed, iter, n, 4, idx);
+}
+
+// Copy match coordinates into separate aligned arrays.
+// const match *m: matches.
+// int n: number of matches.
+// returns: coordinates of the matches, free with free_match_soa.
+match_soa make_match_soa(const match *m, int n)
+{
+    match_soa s;
+    int pad = (n + 15) & ~15;
+    size_t bytes = 4*(size_t)pad*sizeof(float);
+    s.n = n;
+    s.px = aligned_alloc(64, bytes ? bytes : 64);
+    memset(s.px, 0, bytes);
+    s.py = s.px + pad;
+    s.qx = s.py + pad;
+    s.qy = s.qx + pad;
+    for (int i = 0; i < n; i++) {
+        s.px[i] = m[i].p.x;
+        s.py[i] = m[i].p.y;
+        s.qx[i] = m[i].q.x;
+        s.qy[i] = m[i].q.y;
+    }
+    return s;
+}
+
+void free_match_soa(match_soa s)
+{
+    free(s.px);
+}
+
+// Score a homography against all matches. Works on blocks of 64 matches
+// in a loop the compiler vectorizes, and avoids the divide by comparing
+// |(X,Y) - q*Z|^2 against (thresh*Z)^2, which also rejects points that
+// project to infinity.
+// homography h: homography between coordinate systems.
+// match_soa s: match coordinates.
+// float thresh: threshold to be an inlier.
+// unsigned long long *mask: (s.n + 63)/64 words, bit i set if match i is
+//                           an inlier.
+// returns: number of inliers.
+int homography_inlier_mask(homography h, match_soa s, float thresh, unsigned long long *mask)
+{
+    const float h0 = h.h[0], h1 = h.h[1], h2 = h.h[2];
+    const float h3 = h.h[3], h4 = h.h[4], h5 = h.h[5];
+    const float h6 = h.h[6], h7 = h.h[7], h8 = h.h[8];
+    const float t2 = thresh*thresh;
+    int count = 0;
+    for (int b = 0; b < s.n; b += 64) {
+        int e = MIN(64, s.n - b);
+        const float *px = s.px + b, *py = s.py + b;
+        const float *qx = s.qx + b, *qy = s.qy + b;
+        unsigned char in[64];
+        #pragma omp simd
+        for (int i = 0; i < e; i++) {
+            float X = h0*px[i] + h1*py[i] + h2;
+            float Y = h3*px[i] + h4*py[i] + h5;
+            float Z = h6*px[i] + h7*py[i] + h8;
+            float dx = X - qx[i]*Z;
+            float dy = Y - qy[i]*Z;
+            in[i] = dx*dx + dy*dy < t2*Z*Z;
+        }
+        unsigned long long bits = 0;
+        for (int i = 0; i < e; i++) bits |= (unsigned long long)in[i] << i;
+        mask[b/64] = bits;
+        count += __builtin_popcountll(bits);
+    }
+    return count;
+}
+
+// Move the matches marked in an inlier mask to the front of the array.
+// match *m: matches, reordered in place.
+// int n: number of matches.
+// const unsigned long long *mask: inlier mask from homography_inlier_mask.
+// returns: number of inliers.
+int compact_inliers(match *m, int n, const unsigned long long *mask)
+{
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (mask[i/64] >> (i%64) & 1) {
+            match tmp = m[count];
+            m[count++] = m[i];
+            m[i] = tmp;
+        }
+    }
+    return count;
+}
+
+// Refit a homography on its inliers, compacting the matches once.
+// homography *h: model, replaced by the refit if it succeeds.
+// match *m: matches, inliers of the model are moved first.
+// match_soa s: coordinates of the matches.
+// float thresh: threshold to be an inlier.
+static void refit_inliers(homography *h, match *m, match_soa s, float thresh)
+{
+    unsigned long long *mask = calloc((s.n + 63)/64, sizeof(unsigned long long));
+    homography_inlier_mask(*h, s, thresh, mask);
+    int inliers = compact_inliers(m, s.n, mask);
+    homography refit;
+    if (homography_least_squares(m, inliers, &refit)) *h = refit;
+    free(mask);
+}
+
+// RANSAC with hypotheses spread over threads. Each hypothesis draws its
+// sample from a counter-based generator keyed by (seed, hypothesis), so
+// threads share no RNG state and the result does not depend on
+// scheduling. Hypotheses run in batches; once a batch produces a model
+// above the cutoff no further batches start. Ties go to the lowest
+// hypothesis number, which keeps the output reproducible for a seed.
+// match *m: set of matches, reordered so the inliers of the result come first.
+// int n: number of matches.
+// float thresh: inlier/outlier distance threshold.
+// int k: number of iterations to run.
+// int cutoff: inlier cutoff to exit early.
+// unsigned seed: seed for the sampling.
+// returns: matrix representing most common homography between matches.
+matrix RANSAC_parallel(match *m, int n, float thresh, int k, int cutoff, unsigned seed)
+{
+    matrix none = {0};
+    if (n < 4) return none;
+    int best = 0;
+    int besti = k;
+    homography Hb;
+    match_soa c = make_match_soa(m, n);
+
+    for (int start = 0; start < k && best <= cutoff; start += RANSAC_BATCH) {
+        int end = MIN(start + RANSAC_BATCH, k);
+        #pragma omp parallel
+        {
+            int tbest = 0;
+            int ti = k;
+            homography th;
+            unsigned long long *mask = calloc((n + 63)/64, sizeof(unsigned long long));
+            #pragma omp for schedule(dynamic, 16) nowait
+            for (int i = start; i < end; i++) {
+                int idx[4];
+                match s[4];
+                homography H;
+                ransac_sample_4(seed, i, n, idx);
+                for (int j = 0; j < 4; j++) s[j] = m[idx[j]];
+                if (!homography_from_4(s, &H)) continue;
+                int inliers = homography_inlier_mask(H, c, thresh, mask);
+                if (inliers > tbest || (inliers == tbest && i < ti)) {
+                    tbest = inliers;
+                    ti = i;
+                    th = H;
+                }
+            }
+            #pragma omp critical
+            {
+                if (tbest > best || (tbest == best && ti < besti)) {
+                    best = tbest;
+                    besti = ti;
+                    Hb = th;
+                }
+            }
+            free(mask);
+        }
+    }
+    if (best) refit_inliers(&Hb, m, c, thresh);
+    free_match_soa(c);
+    return best ? homography_to_matrix(Hb) : none;
+}
+
+// RANSAC with PROSAC sampling. Instead of drawing uniformly from all the
+// matches, hypotheses are drawn from the top n matches by quality and n
+// grows on the schedule from Chum and Matas, "Matching with PROSAC", so
+// good models built from the best ranked matches are found in the first
+// few iterations. The schedule is set with T_N = k, so the pool grows
+// towards all n matches over the whole run but by at most one match per
+// iteration. It covers every match only near the end, and never when
+// k < n - 4, so with an uninformative ordering this is weaker than plain
+// RANSAC for the same k.
+// match *m: set of matches sorted best first, as match_descriptors returns
+//           them. Reordered so the inliers of the result come first.
+// int n: number of matches.
+// float thresh: inlier/outlier distance threshold.
+// int k: number of iterations to run.
+// int cutoff: inlier cutoff to exit early.
+// unsigned seed: seed for the sampling.
+// returns: matrix representing most common homography between matches.
+matrix RANSAC_prosac(match *m, int n, float thresh, int k, int cutoff, unsigned seed)
+{
+    matrix none = {0};
+    if (n < 4) return none;
+    int best = 0;
+    homography Hb;
+    match_soa c = make_match_soa(m, n);
+    unsigned long long *mask = calloc((n + 63)/64, sizeof(unsigned long long));
+
+    // Expected number of samples drawn from the top 'top' matches, T_n,
+    // and the iteration at which the pool grows to top + 1, T'_n.
+    int top = 4;
+    double tn = k;
+    for (int i = 0; i < 4; i++) tn *= (double)(top - i)/(n - i);
+    double grow = 1;
+
+    for (int t = 1; t <= k && best <= cutoff; t++) {
+        if (t >= grow && top < n) {
+            double next = tn*(top + 1)/(top + 1 - 4);
+            grow += ceil(next - tn);
+            tn = next;
+            top++;
+        }
+        int idx[4];
+        if (top < n && grow >= t) {
+            // The newest match in the pool is always part of the sample.
+            sample_distinct(seed, t, top - 1, 3, idx);
+            idx[3] = top - 1;
+        } else {
+            sample_distinct(seed, t, top, 4, idx);
+        }
+        match s[4];
+        homography H;
+        for (int j = 0; j < 4; j++) s[j] = m[idx[j]];
+        if (!homography_from_4(s, &H)) continue;
+        int inliers = homography_inlier_mask(H, c, thresh, mask);
+        if (inliers > best) {
+            best = inliers;
+            Hb = H;
+        }
+    }
+    if (best) refit_inliers(&Hb, m, c, thresh);
+    free(mask);
+    free_match_soa(c);
+    return best ? homography_to_matrix(Hb) : none;
+}
+
+// Number of RANSAC iterations needed to draw at least one all-inlier
+// sample with a given confidence.
+// float ratio: fraction of matches that are inliers.
+// float confidence: probability of success wanted, e.g. .99
+// int k: maximum number of iterations.
+// returns: iterations needed, at most k.
+int ransac_iterations(float ratio, float confidence, int k)
+{
+    double w = pow(ratio, 4);
+    if (w <= 0) return k;
+    if (w >= 1) return 1;
+    double needed = log(1 - confidence)/log(1 - w);
+    return needed < k ? (int)ceil(needed) : k;
+}
+
+// Decision threshold of the sequential probability ratio test, from Matas
+// and Chum, "Randomized RANSAC with Sequential Probability Ratio Test".
+// double epsilon: probability a match is consistent with a good model.
+// double delta: probability a match is consistent with a bad model.
+// returns: threshold on the likelihood ratio to reject a model.
+static double sprt_threshold(double epsilon, double delta)
+{
+    // Cost of fitting a hypothesis, in units of checking one match.
+    const double tm = 200;
+    if (epsilon <= delta) return FLT_MAX;
+    double c = (1 - delta)*log((1 - delta)/(1 - epsilon)) + delta*log(delta/epsilon);
+    double a = tm*c + 1;
+    for (int i = 0; i < 10; i++) a = tm*c + 1 + log(a);
+    return a;
+}
+
+// RANSAC with adaptive termination and early rejection of bad hypotheses.
+// Each hypothesis is verified with a sequential probability ratio test
+// that stops checking matches as soon as the model is likely bad, so most
+// hypotheses only look at a handful of matches. The number of iterations
+// is recomputed from the inlier ratio of the best model so far.
+// match *m: set of matches, reordered so the inliers of the result come first.
+// int n: number of matches.
+// float thresh: inlier/outlier distance threshold.
+// int k: maximum number of iterations to run.
+// float confidence: probability of finding the best model. Typical: .99
+// unsigned seed: seed for the sampling.
+// int *iters: if not NULL, filled with the number of iterations run.
+// returns: matrix representing most common homography between matches.
+matrix RANSAC_adaptive(match *m, int n, float thresh, int k, float confidence, unsigned seed, int *iters)
+{
+    matrix none = {0};
+    if (iters) *iters = 0;
+    if (n < 4) return none;
+    int best = 0;
+    homography Hb;
+
+    // Initial guesses, replaced by the best model's inlier ratio and the
+    // consistency of rejected models as they come in.
+    double epsilon = .1;
+    double delta = .01;
+    double A = sprt_threshold(epsilon, delta);
+    double rejected_sum = 0;
+    int rejected = 0;
+    int needed = k;
+    int t;
+
+    for (t = 0; t < needed; t++) {
+        int idx[4];
+        match s[4];
+        homography H;
+        ransac_sample_4(seed, t, n, idx);
+        for (int j = 0; j < 4; j++) s[j] = m[idx[j]];
+        if (!homography_from_4(s, &H)) continue;
+
+        double up = delta/epsilon;
+        double down = (1 - delta)/(1 - epsilon);
+        double lambda = 1;
+        int good = 1;
+        int consistent = 0;
+        int checked = 0;
+        // Walk the matches from a random start, they are sorted by quality.
+        int i = ((unsigned long long)ransac_random(~seed, t) * n) >> 32;
+        for (int j = 0; j < n; j++, i = i + 1 < n ? i + 1 : 0) {
+            int in = point_distance(project_point_h(H, m[i].p), m[i].q) < thresh;
+            consistent += in;
+            checked++;
+            lambda *= in ? up : down;
+            if (lambda > A) {
+                good = 0;
+                break;
+            }
+        }
+
+        if (!good) {
+            // Track how consistent bad models are and adjust the test.
+            rejected_sum += (double)consistent/checked;
+            rejected++;
+            double d = MAX(rejected_sum/rejected, 1e-4);
+            if (fabs(d - delta) > .05*delta) {
+                delta = d;
+                A = sprt_threshold(epsilon, delta);
+            }
+            continue;
+        }
+        if (consistent > best) {
+            best = consistent;
+            Hb = H;
+            epsilon = (double)best/n;
+            A = sprt_threshold(epsilon, delta);
+            // Good models also fail the test with probability 1/A.
+            needed = ransac_iterations((float)best/n*pow(1 - 1/A, .25), confidence, k);
+            needed = MAX(needed, t + 1);
+        }
+    }
+    if (iters) *iters = t;
+    if (!best) return none;
+
+    match_soa c = make_match_soa(m, n);
+    refit_inliers(&Hb, m, c, thresh);
+    free_match_soa(c);
+    return homography_to_matrix(Hb);
+}
@@ -0,0 +1,395 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "matrix.h"
+
+// Store one source coordinate in a remap table.
+// remap r: table to fill.
+// int i: index of the output pixel.
+// float x, y: source coordinates the output pixel samples from.
+void set_remap_entry(remap r, int i, float x, float y)
+{
+    if (!(x >= 0 && y >= 0 && x <= r.sw - 1 && y <= r.sh - 1)) {
+        r.offset[i] = -1;
+        return;
+    }
+    int x0 = x;
+    int y0 = y;
+    // Keep both taps inside the image so sampling never has to clamp.
+    if (x0 > r.sw - 2) x0 = MAX(r.sw - 2, 0);
+    if (y0 > r.sh - 2) y0 = MAX(r.sh - 2, 0);
+    float fx = MIN(x - x0, 1);
+    float fy = MIN(y - y0, 1);
+    r.offset[i] = y0*r.sw + x0;
+    r.fx[i] = fx*REMAP_ONE + .5;
+    r.fy[i] = fy*REMAP_ONE + .5;
+}
+
+// Allocate an empty remap table.
+// int w, h: size of the output image.
+// int sw, sh: size of the source image the table samples from.
+// returns: table with every output pixel marked as outside the source.
+remap make_remap(int w, int h, int sw, int sh)
+{
+    remap r;
+    r.w = w; r.h = h;
+    r.sw = sw; r.sh = sh;
+    r.offset = malloc(w*h*sizeof(int));
+    r.fx = calloc(w*h, sizeof(unsigned short));
+    r.fy = calloc(w*h, sizeof(unsigned short));
+    memset(r.offset, -1, w*h*sizeof(int));
+    return r;
+}
+
+void free_remap(remap r)
+{
+    free(r.offset);
+    free(r.fx);
+    free(r.fy);
+}
+
+// Build a remap table for a projective transformation.
+// matrix H: homography from output coordinates to source coordinates.
+// int w, h: size of the output image.
+// int sw, sh: size of the source image.
+// float ox, oy: output pixel (0,0) corresponds to (ox,oy) before projection.
+// returns: remap table.
+remap make_homography_remap(matrix H, int w, int h, int sw, int sh, float ox, float oy)
+{
+    remap r = make_remap(w, h, sw, sh);
+    #pragma omp parallel for
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            double x = i + ox, y = j + oy;
+            double X = H.data[0][0]*x + H.data[0][1]*y + H.data[0][2];
+            double Y = H.data[1][0]*x + H.data[1][1]*y + H.data[1][2];
+            double Z = H.data[2][0]*x + H.data[2][1]*y + H.data[2][2];
+            if (Z == 0) continue;
+            set_remap_entry(r, j*w + i, X/Z, Y/Z);
+        }
+    }
+    return r;
+}
+
+// Build a remap table that projects an image onto a cylinder and unrolls it.
+// int w, h: size of the source (and output) image.
+// float f: focal length used to take the image (in pixels).
+// returns: remap table.
+remap make_cylindrical_remap(int w, int h, float f)
+{
+    remap r = make_remap(w, h, w, h);
+    float xc = w/2., yc = h/2.;
+    #pragma omp parallel for
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            float theta = (i - xc)/f;
+            float hh = (j - yc)/f;
+            float Z = cosf(theta);
+            if (Z <= 0) continue;
+            set_remap_entry(r, j*w + i, f*sinf(theta)/Z + xc, f*hh/Z + yc);
+        }
+    }
+    return r;
+}
+
+// Build a remap table that projects an image onto a sphere and unrolls it.
+// int w, h: size of the source (and output) image.
+// float f: focal length used to take the image (in pixels).
+// returns: remap table.
+remap make_spherical_remap(int w, int h, float f)
+{
+    remap r = make_remap(w, h, w, h);
+    float xc = w/2., yc = h/2.;
+    #pragma omp parallel for
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            float theta = (i - xc)/f;
+            float phi = (j - yc)/f;
+            float Z = cosf(theta)*cosf(phi);
+            if (Z <= 0) continue;
+            set_remap_entry(r, j*w + i, f*sinf(theta)*cosf(phi)/Z + xc, f*sinf(phi)/Z + yc);
+        }
+    }
+    return r;
+}
+
+// A cached projection table shared between the cache and the projections
+// applying it.
+// remap r: the table.
+// int refs: one for the cache while it holds the table, plus one for each
+//           projection using it. Changed only in critical(remap_cache).
+typedef struct{
+    remap r;
+    int refs;
+} shared_remap;
+
+// Projection tables kept around for reuse, keyed by kind and (w, h, f).
+#define REMAP_CACHE_SIZE 8
+typedef struct{
+    int kind, w, h;
+    float f;
+    unsigned long stamp;
+    shared_remap *t;
+} remap_cache_entry;
+static remap_cache_entry remap_cache[REMAP_CACHE_SIZE];
+static int remap_cache_n = 0;
+static unsigned long remap_cache_clock = 0;
+
+// Find a table in the cache and take a reference to it. Call only in
+// critical(remap_cache).
+// returns: the table, 0 on a miss.
+static shared_remap *remap_cache_find(int kind, int w, int h, float f)
+{
+    for (int i = 0; i < remap_cache_n; i++) {
+        remap_cache_entry *e = remap_cache + i;
+        if (e->kind == kind && e->w == w && e->h == h && e->f == f) {
+            e->stamp = ++remap_cache_clock;
+            e->t->refs++;
+            return e->t;
+        }
+    }
+    return 0;
+}
+
+// Drop a reference to a table. Call only in critical(remap_cache).
+// returns: the table if that was the last reference and it should be
+//          freed, otherwise 0.
+static shared_remap *remap_release(shared_remap *t)
+{
+    return --t->refs == 0 ? t : 0;
+}
+
+static void free_shared_remap(shared_remap *t)
+{
+    if (!t) return;
+    free_remap(t->r);
+    free(t);
+}
+
+// Warp an image with a cylindrical or spherical table from the cache,
+// building it on a miss and evicting the least recently used table if
+// the cache is full. The lock covers only the lookup, insertion and
+// reference counts. Tables are built and applied outside it, and an
+// evicted table is freed once the last projection using it is done.
+// image im: image to project.
+// int kind: 0 for cylindrical, 1 for spherical.
+// float f: focal length used to take the image (in pixels).
+// returns: projected image.
+static image project_cached(image im, int kind, float f)
+{
+    shared_remap *t, *dead = 0, *evicted = 0;
+    #pragma omp critical(remap_cache)
+    t = remap_cache_find(kind, im.w, im.h, f);
+
+    if (!t) {
+        shared_remap *built = calloc(1, sizeof(shared_remap));
+        built->r = kind ? make_spherical_remap(im.w, im.h, f) : make_cylindrical_remap(im.w, im.h, f);
+        built->refs = 1;
+        #pragma omp critical(remap_cache)
+        {
+            // Another thread may have built the same table meanwhile.
+            t = remap_cache_find(kind, im.w, im.h, f);
+            if (t) {
+                dead = built;
+            } else {
+                int slot = remap_cache_n;
+                if (remap_cache_n < REMAP_CACHE_SIZE) {
+                    remap_cache_n++;
+                } else {
+                    slot = 0;
+                    for (int i = 1; i < remap_cache_n; i++) {
+                        if (remap_cache[i].stamp < remap_cache[slot].stamp) slot = i;
+                    }
+                    evicted = remap_release(remap_cache[slot].t);
+                }
+                remap_cache_entry *e = remap_cache + slot;
+                e->kind = kind; e->w = im.w; e->h = im.h; e->f = f;
+                e->stamp = ++remap_cache_clock;
+                e->t = built;
+                built->refs++;
+                t = built;
+            }
+        }
+        free_shared_remap(dead);
+        free_shared_remap(evicted);
+    }
+
+    image out = apply_remap(im, t->r);
+    #pragma omp critical(remap_cache)
+    dead = remap_release(t);
+    free_shared_remap(dead);
+    return out;
+}
+
+// Project an image onto a cylinder and unroll it. The lookup table for
+// each image size and focal length is built once and cached.
+// image im: image to project.
+// float f: focal length used to take image (in pixels).
+// returns: image projected onto cylinder, then flattened.
+image cylindrical_project(image im, float f)
+{
+    return project_cached(im, 0, f);
+}
+
+// Project an image onto a sphere and unroll it, with a cached table.
+// image im: image to project.
+// float f: focal length used to take image (in pixels).
+// returns: image projected onto sphere, then flattened.
+image spherical_project(image im, float f)
+{
+    return project_cached(im, 1, f);
+}
+
+// Free all cached projection tables. Tables still being applied are
+// freed when their projection finishes.
+void free_projection_cache()
+{
+    shared_remap *dead[REMAP_CACHE_SIZE];
+    int n = 0;
+    #pragma omp critical(remap_cache)
+    {
+        for (int i = 0; i < remap_cache_n; i++) {
+            shared_remap *t = remap_release(remap_cache[i].t);
+            if (t) dead[n++] = t;
+        }
+        remap_cache_n = 0;
+    }
+    for (int i = 0; i < n; i++) free_shared_remap(dead[i]);
+}
+
+// Build a remap table from an arbitrary coordinate field.
+// image field: 2 channel image, channel 0 is source x, channel 1 source y.
+// int sw, sh: size of the source image.
+// returns: remap table the size of field.
+remap make_field_remap(image field, int sw, int sh)
+{
+    assert(field.c >= 2);
+    remap r = make_remap(field.w, field.h, sw, sh);
+    int n = field.w*field.h;
+    for (int i = 0; i < n; i++) {
+        set_remap_entry(r, i, field.data[i], field.data[i + n]);
+    }
+    return r;
+}
+
+// Warp an image into an existing image with a remap table.
+// Pixels that fall outside the source are left untouched.
+// image im: source image, must be the size the table was built for.
+// remap r: table to apply.
+// image out: destination, must be r.w x r.h with at least im.c channels.
+void apply_remap_into(image im, remap r, image out)
+{
+    assert(im.w == r.sw && im.h == r.sh);
+    assert(out.w == r.w && out.h == r.h && out.c >= im.c);
+    const float scale = 1./REMAP_ONE;
+    int step = im.w > 1 ? 1 : 0;
+    int down = im.h > 1 ? im.w : 0;
+    #pragma omp parallel for
+    for (int j = 0; j < r.h; j++) {
+        const int *off = r.offset + j*r.w;
+        const unsigned short *fx = r.fx + j*r.w;
+        const unsigned short *fy = r.fy + j*r.w;
+        for (int k = 0; k < im.c; k++) {
+            const float *src = im.data + k*im.w*im.h;
+            float *dst = out.data + k*out.w*out.h + j*out.w;
+            for (int i = 0; i < r.w; i++) {
+                if (off[i] < 0) continue;
+                const float *p = src + off[i];
+                float ax = fx[i]*scale, ay = fy[i]*scale;
+                float top = p[0] + ax*(p[step] - p[0]);
+                float bot = p[down] + ax*(p[down + step] - p[down]);
+                dst[i] = top + ay*(bot - top);
+            }
+        }
+    }
+}
+
+// Warp an image with a remap table.
+// image im: source image, must be the size the table was built for.
+// remap r: table to apply.
+// returns: r.w x r.h warped image, black where outside the source.
+image apply_remap(image im, remap r)
+{
+    image out = make_image(r.w, r.h, im.c);
+    apply_remap_into(im, r, out);
+    return out;
+}
+
+// Sample every channel of an image with bilinear interpolation, using the
+// edge pixel for taps past the last row or column.
+// image im: image to sample.
+// float x, y: coordinates to sample, 0 <= x < im.w and 0 <= y < im.h.
+// float *v: filled with im.c values.
+void bilinear_sample(image im, float x, float y, float *v)
+{
+    int x0 = x, y0 = y;
+    int step = x0 + 1 < im.w ? 1 : 0;
+    int down = y0 + 1 < im.h ? im.w : 0;
+    float ax = x - x0, ay = y - y0;
+    const float *p = im.data + y0*im.w + x0;
+    for (int k = 0; k < im.c; k++, p += im.w*im.h) {
+        float top = p[0] + ax*(p[step] - p[0]);
+        float bot = p[down] + ax*(p[down + step] - p[down]);
+        v[k] = top + ay*(bot - top);
+    }
+}
+
+// Narrow [lo, hi] to the i where c + s*i > 0, give or take a pixel.
+static void clip_span(double c, double s, int *lo, int *hi)
+{
+    if (s == 0) {
+        if (c < 0) *hi = *lo - 1;
+        return;
+    }
+    double r = -c/s;
+    if (s > 0 && r - 1 > *lo) *lo = MIN(r - 1, *hi + 1);
+    if (s < 0 && r + 1 < *hi) *hi = MAX(r + 1, *lo - 1);
+}
+
+// Inverse-warp an image into a rectangle of another with a homography.
+// Rows run in parallel. Along a row the source coordinates are linear in
+// homogeneous form, so the span where the source is valid is solved for
+// up front and only those pixels are projected and sampled.
+// image src: image to sample from.
+// homography H: maps (i + ox, j + oy) for output pixel (i, j) into src.
+// image out: destination, pixels outside src's footprint are untouched.
+// int ox, oy: offset of out's pixel grid in H's input frame.
+// int x0, y0, x1, y1: rectangle of out to fill, x1 and y1 exclusive.
+void warp_homography_into(image src, homography H, image out, int ox, int oy, int x0, int y0, int x1, int y1)
+{
+    const double *h = H.h;
+    int c = MIN(src.c, out.c);
+    x0 = MAX(x0, 0); y0 = MAX(y0, 0);
+    x1 = MIN(x1, out.w); y1 = MIN(y1, out.h);
+    #pragma omp parallel
+    {
+        float *v = calloc(src.c, sizeof(float));
+        #pragma omp for schedule(dynamic, 8)
+        for (int j = y0; j < y1; j++) {
+            double y = j + oy;
+            // Row start at i = 0 and the per pixel steps.
+            double X0 = h[0]*ox + h[1]*y + h[2];
+            double Y0 = h[3]*ox + h[4]*y + h[5];
+            double Z0 = h[6]*ox + h[7]*y + h[8];
+            int lo = x0, hi = x1 - 1;
+            clip_span(Z0, h[6], &lo, &hi);
+            clip_span(X0, h[0], &lo, &hi);
+            clip_span(Y0, h[3], &lo, &hi);
+            clip_span(src.w*Z0 - X0, src.w*h[6] - h[0], &lo, &hi);
+            clip_span(src.h*Z0 - Y0, src.h*h[6] - h[3], &lo, &hi);
+
+            double X = X0 + h[0]*lo, Y = Y0 + h[3]*lo, Z = Z0 + h[6]*lo;
+            for (int i = lo; i <= hi; i++, X += h[0], Y += h[3], Z += h[6]) {
+                if (Z <= 0) continue;
+                float px = X/Z, py = Y/Z;
+                if (!(px >= 0 && py >= 0 && px < src.w && py < src.h)) continue;
+                bilinear_sample(src, px, py, v);
+                for (int k = 0; k < c; k++) out.data[(k*out.h + j)*out.w + i] = v[k];
+            }
+        }
+        free(v);
+    }
+}
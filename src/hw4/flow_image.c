@@ -6,6 +6,9 @@
 #include "image.h"
 #include "matrix.h"
 
+// Smallest eigenvalue of the windowed gradient matrix to solve for flow.
+#define FLOW_MIN_EIG 1e-6
+
 // Draws a line on an image with color corresponding to the direction of line
 // image im: image to draw line on
 // float x, y: starting point of line
@@ -214,6 +217,223 @@ image optical_flow_images(image im, image prev, int smooth, int stride)
     return vs;
 }
 
+// Build an image pyramid for pyramidal optical flow. A frame's pyramid
+// can be kept and passed as prev for the next pair, so each frame is
+// only reduced once.
+// image im: image, converted to grayscale if it has 3 channels.
+// int levels: number of levels, fewer if the image gets too small.
+// returns: pyramid, free with free_flow_pyramid.
+flow_pyramid make_flow_pyramid(image im, int levels)
+{
+    flow_pyramid p = {0};
+    p.im = calloc(levels, sizeof(image));
+    p.gx = calloc(levels, sizeof(image));
+    p.gy = calloc(levels, sizeof(image));
+    p.im[0] = im.c == 3 ? rgb_to_grayscale(im) : copy_image(im);
+    p.levels = 1;
+    while (p.levels < levels && p.im[p.levels-1].w >= 32 && p.im[p.levels-1].h >= 32) {
+        p.im[p.levels] = pyramid_down(p.im[p.levels-1]);
+        p.levels++;
+    }
+    // Central differences, in pixels of each level.
+    for (int l = 0; l < p.levels; l++) {
+        image g = p.im[l];
+        p.gx[l] = make_image(g.w, g.h, 1);
+        p.gy[l] = make_image(g.w, g.h, 1);
+        #pragma omp parallel for
+        for (int y = 0; y < g.h; y++) {
+            const float *row = g.data + y*g.w;
+            const float *up = g.data + MAX(y-1, 0)*g.w;
+            const float *down = g.data + MIN(y+1, g.h-1)*g.w;
+            for (int x = 0; x < g.w; x++) {
+                p.gx[l].data[y*g.w + x] = .5*(row[MIN(x+1, g.w-1)] - row[MAX(x-1, 0)]);
+                p.gy[l].data[y*g.w + x] = .5*(down[x] - up[x]);
+            }
+        }
+    }
+    return p;
+}
+
+// Free the levels of a flow pyramid.
+// flow_pyramid p: pyramid to free.
+void free_flow_pyramid(flow_pyramid p)
+{
+    for (int l = 0; l < p.levels; l++) {
+        free_image(p.im[l]);
+        free_image(p.gx[l]);
+        free_image(p.gy[l]);
+    }
+    free(p.im);
+    free(p.gx);
+    free(p.gy);
+}
+
+// Replace each channel of an image with its mean over an s x s window,
+// clamped at the edges, using running sums along rows then columns.
+// image im: image to filter in place.
+// int s: window size.
+static void box_mean(image im, int s)
+{
+    int r = s/2;
+    float norm = 1./((2*r + 1)*(2*r + 1));
+    image tmp = make_image(im.w, im.h, im.c);
+    for (int c = 0; c < im.c; c++) {
+        float *d = im.data + c*im.w*im.h;
+        float *t = tmp.data + c*im.w*im.h;
+        #pragma omp parallel for
+        for (int y = 0; y < im.h; y++) {
+            const float *row = d + y*im.w;
+            float sum = 0;
+            for (int i = -r; i <= r; i++) sum += row[MIN(MAX(i, 0), im.w-1)];
+            for (int x = 0; x < im.w; x++) {
+                t[y*im.w + x] = sum;
+                sum += row[MIN(x+r+1, im.w-1)] - row[MAX(x-r, 0)];
+            }
+        }
+        #pragma omp parallel
+        {
+            float *sum = calloc(im.w, sizeof(float));
+            #pragma omp for
+            for (int x0 = 0; x0 < im.w; x0 += 64) {
+                int x1 = MIN(x0 + 64, im.w);
+                for (int x = x0; x < x1; x++) sum[x] = 0;
+                for (int i = -r; i <= r; i++) {
+                    const float *row = t + MIN(MAX(i, 0), im.h-1)*im.w;
+                    for (int x = x0; x < x1; x++) sum[x] += row[x];
+                }
+                for (int y = 0; y < im.h; y++) {
+                    const float *add = t + MIN(y+r+1, im.h-1)*im.w;
+                    const float *sub = t + MAX(y-r, 0)*im.w;
+                    for (int x = x0; x < x1; x++) {
+                        d[y*im.w + x] = sum[x]*norm;
+                        sum[x] += add[x] - sub[x];
+                    }
+                }
+            }
+            free(sum);
+        }
+    }
+    free_image(tmp);
+}
+
+// Pyramidal iterative Lucas-Kanade flow, after Bouguet, "Pyramidal
+// Implementation of the Lucas Kanade Feature Tracker". Flow is solved at
+// the coarsest level first, then doubled and refined at each finer level
+// by warping im with the current estimate and solving for what is left,
+// so motions far beyond a pixel are followed without heavy smoothing.
+// Gradients come from prev and stay fixed across iterations.
+// flow_pyramid im: pyramid of the current image.
+// flow_pyramid prev: pyramid of the previous image, same size.
+// int win: window size for the least squares sums.
+// int iters: refinement steps per level. Typical: 2-5
+// int stride: downsampling for velocity matrix.
+// returns: velocity matrix, prev(x, y) moved to im(x + vx, y + vy).
+image pyramid_flow(flow_pyramid im, flow_pyramid prev, int win, int iters, int stride)
+{
+    assert(im.im[0].w == prev.im[0].w && im.im[0].h == prev.im[0].h);
+    int levels = MIN(im.levels, prev.levels);
+    image u = make_image(1, 1, 2);
+
+    for (int l = levels - 1; l >= 0; l--) {
+        image I = im.im[l], P = prev.im[l];
+        image gx = prev.gx[l], gy = prev.gy[l];
+        int w = P.w, h = P.h, n = w*h;
+
+        // Start from the coarser level's flow, in this level's pixels.
+        image f = make_image(w, h, 2);
+        if (l < levels - 1) {
+            #pragma omp parallel for
+            for (int y = 0; y < h; y++) {
+                float v[2];
+                for (int x = 0; x < w; x++) {
+                    bilinear_sample(u, MIN(x*.5f, u.w - 1), MIN(y*.5f, u.h - 1), v);
+                    f.data[y*w + x] = 2*v[0];
+                    f.data[n + y*w + x] = 2*v[1];
+                }
+            }
+        }
+        free_image(u);
+        u = f;
+
+        image S = make_image(w, h, 3);
+        for (int i = 0; i < n; i++) {
+            S.data[i] = gx.data[i]*gx.data[i];
+            S.data[n + i] = gy.data[i]*gy.data[i];
+            S.data[2*n + i] = gx.data[i]*gy.data[i];
+        }
+        box_mean(S, win);
+
+        // Each iteration solves the window's least squares with every term
+        // linearized around the window center's flow, g.(u(x) - u(y)) is
+        // added to the difference at y, so the sums of all pixels can still
+        // be taken with one box filter. Without it neighbours with different
+        // flow feed each other's error back and the iterations diverge.
+        image b = make_image(w, h, 2);
+        for (int it = 0; it < iters; it++) {
+            #pragma omp parallel for
+            for (int y = 0; y < h; y++) {
+                for (int x = 0; x < w; x++) {
+                    int i = y*w + x;
+                    float ux = u.data[i], uy = u.data[n + i];
+                    float sx = x + ux, sy = y + uy;
+                    // Pixels that moved out of im say nothing about the flow.
+                    float t = 0;
+                    if (sx >= 0 && sy >= 0 && sx <= w - 1 && sy <= h - 1) {
+                        bilinear_sample(I, sx, sy, &t);
+                        t -= P.data[i] + gx.data[i]*ux + gy.data[i]*uy;
+                    }
+                    b.data[i] = gx.data[i]*t;
+                    b.data[n + i] = gy.data[i]*t;
+                }
+            }
+            box_mean(b, win);
+            for (int i = 0; i < n; i++) {
+                float xx = S.data[i], yy = S.data[n + i], xy = S.data[2*n + i];
+                // Keep the flow where the window lacks texture in some
+                // direction, its smaller eigenvalue is too small to trust.
+                float det = xx*yy - xy*xy;
+                float half = .5*(xx + yy);
+                if (half - sqrtf(MAX(half*half - det, 0)) < FLOW_MIN_EIG) continue;
+                u.data[i] = -(yy*b.data[i] - xy*b.data[n + i])/det;
+                u.data[n + i] = -(xx*b.data[n + i] - xy*b.data[i])/det;
+            }
+        }
+        free_image(b);
+        free_image(S);
+    }
+
+    image v = make_image(u.w/stride, u.h/stride, 3);
+    for (int j = 0; j < v.h; j++) {
+        for (int i = 0; i < v.w; i++) {
+            int k = (j*stride + (stride-1)/2)*u.w + i*stride + (stride-1)/2;
+            v.data[j*v.w + i] = u.data[k];
+            v.data[v.w*v.h + j*v.w + i] = u.data[u.w*u.h + k];
+        }
+    }
+    free_image(u);
+    return v;
+}
+
+// Calculate the optical flow between two images with pyramidal
+// Lucas-Kanade. To track a sequence, build each frame's pyramid once with
+// make_flow_pyramid and call pyramid_flow instead.
+// image im: current image
+// image prev: previous image
+// int levels: number of pyramid levels. Typical: 3-5
+// int win: window size for the least squares sums.
+// int iters: refinement steps per level.
+// int stride: downsampling for velocity matrix
+// returns: velocity matrix
+image optical_flow_pyramid(image im, image prev, int levels, int win, int iters, int stride)
+{
+    flow_pyramid a = make_flow_pyramid(im, levels);
+    flow_pyramid b = make_flow_pyramid(prev, levels);
+    image v = pyramid_flow(a, b, win, iters, stride);
+    free_flow_pyramid(a);
+    free_flow_pyramid(b);
+    return v;
+}
+
 // Run optical flow demo on webcam
 // int smooth: amount to smooth structure matrix by
 // int stride: downsampling for velocity matrix
@@ -250,3 +470,43 @@ void optical_flow_webcam(int smooth, int stride, int div)
     fprintf(stderr, "Must compile with OpenCV\n");
 #endif
 }
+
+// Run pyramidal optical flow demo on webcam. Each frame's pyramid is built
+// once and reused as the previous frame for the next pair.
+// int levels: number of pyramid levels.
+// int stride: downsampling for velocity matrix
+// int div: downsampling factor for images from webcam
+void optical_flow_webcam_pyramid(int levels, int stride, int div)
+{
+#ifdef OPENCV
+    void * cap;
+    cap = open_video_stream(0, 0, 1280, 720, 30);
+    image im = get_image_from_stream(cap);
+    image im_c = nn_resize(im, im.w/div, im.h/div);
+    flow_pyramid prev = make_flow_pyramid(im_c, levels);
+    free_image(im);
+    free_image(im_c);
+    im = get_image_from_stream(cap);
+    while(im.data){
+        im_c = nn_resize(im, im.w/div, im.h/div);
+        flow_pyramid cur = make_flow_pyramid(im_c, levels);
+        image v = pyramid_flow(cur, prev, 9, 3, stride);
+        draw_flow(im, v, div);
+        int key = show_image(im, "flow", 5);
+        free_image(v);
+        free_image(im);
+        free_image(im_c);
+        free_flow_pyramid(prev);
+        prev = cur;
+        if(key != -1) {
+            key = key % 256;
+            printf("%d\n", key);
+            if (key == 27) break;
+        }
+        im = get_image_from_stream(cap);
+    }
+    free_flow_pyramid(prev);
+#else
+    fprintf(stderr, "Must compile with OpenCV\n");
+#endif
+}
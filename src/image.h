@@ -25,6 +25,27 @@ typedef struct{
     float x, y;
 } point;
 
+// A 3x3 homography stored inline, no allocation.
+// double h[9]: row-major values.
+typedef struct{
+    double h[9];
+} homography;
+
+// Apply a homography to a point.
+// homography H: homography to project point.
+// point p: point to project.
+// returns: point projected using the homography.
+static inline point project_point_h(homography H, point p)
+{
+    double x = H.h[0]*p.x + H.h[1]*p.y + H.h[2];
+    double y = H.h[3]*p.x + H.h[4]*p.y + H.h[5];
+    double w = H.h[6]*p.x + H.h[7]*p.y + H.h[8];
+    point q;
+    q.x = x/w;
+    q.y = y/w;
+    return q;
+}
+
 // A descriptor for a point in an image.
 // point p: x,y coordinates of the image pixel.
 // int n: the number of floating point values in the descriptor.
@@ -35,6 +56,36 @@ typedef struct{
     float *data;
 } descriptor;
 
+// A set of descriptors stored contiguously, structure-of-arrays style.
+// int n: number of descriptors.
+// int dim: number of floating point values in each descriptor.
+// int stride: floats between descriptors, dim padded with zeros.
+// float *x, *y: coordinates of the image pixels.
+// float *data: n*stride descriptor values, one aligned block that also
+//              holds x and y, so freeing it frees everything.
+typedef struct{
+    int n, dim, stride;
+    float *x, *y;
+    float *data;
+} descriptor_set;
+
+// The two nearest neighbours of a query descriptor.
+// int best, second: indexes of the nearest and second nearest candidate.
+// float d1, d2: their distances.
+typedef struct{
+    int best, second;
+    float d1, d2;
+} knn2;
+
+// A binary descriptor for a point in an image.
+// point p: x,y coordinates of the image pixel.
+// unsigned long long bits[4]: BRIEF_BITS intensity comparisons.
+#define BRIEF_BITS 256
+typedef struct{
+    point p;
+    unsigned long long bits[BRIEF_BITS/64];
+} binary_descriptor;
+
 // A match between two points in an image.
 // point p, q: x,y coordinates of the two matching pixels.
 // int ai, bi: indexes in the descriptor array. For eliminating duplicates.
@@ -45,10 +96,42 @@ typedef struct{
     float distance;
 } match;
 
+// Match coordinates as separate arrays, for scoring many matches at once.
+// int n: number of matches.
+// float *px, *py: coordinates in the first image.
+// float *qx, *qy: coordinates in the second image. All four arrays live
+//                 in the aligned block at px, padded to 16 floats.
+typedef struct{
+    int n;
+    float *px, *py, *qx, *qy;
+} match_soa;
+
+// Stages of the stitching pipeline.
+typedef enum{
+    PIPE_LOAD, PIPE_DETECT, PIPE_MATCH, PIPE_RANSAC, PIPE_WARP, PIPE_STAGES
+} pipeline_stage;
+
+// Time a stitching pipeline spent, in seconds.
+// double stage[]: time in each stage's tasks, summed over threads.
+// double wall: wall time of the whole run.
+typedef struct{
+    double stage[PIPE_STAGES];
+    double wall;
+} pipeline_times;
+
+// A local maximum in a response map.
+// point p: x,y coordinates of the peak.
+// float v: response at the peak.
+typedef struct{
+    point p;
+    float v;
+} peak;
+
 // Basic operations
 float get_pixel(image im, int x, int y, int c);
 void set_pixel(image im, int x, int y, int c, float v);
 image copy_image(image im);
+image crop_image(image im, int x, int y, int w, int h);
 image rgb_to_grayscale(image im);
 image grayscale_to_rgb(image im, float r, float g, float b);
 void rgb_to_hsv(image im);
@@ -64,6 +147,7 @@ image add_image(image a, image b);
 // Loading and saving
 image make_image(int w, int h, int c);
 image load_image(char *filename);
+image load_image_stb(char *filename, int channels);
 void save_image(image im, const char *name);
 void save_png(image im, const char *name);
 void save_image_binary(image im, const char *fname);
@@ -76,6 +160,8 @@ float nn_interpolate(image im, float x, float y, int c);
 image nn_resize(image im, int w, int h);
 float bilinear_interpolate(image im, float x, float y, int c);
 image bilinear_resize(image im, int w, int h);
+image bilinear_resize_batch(image *ims, int n, int w, int h);
+image load_resize_batch(char **paths, int n, int w, int h, int c);
 
 // Filtering
 image convolve_image(image im, image filter, int preserve);
@@ -92,31 +178,159 @@ void threshold_image(image im, float thresh);
 image *sobel_image(image im);
 image colorize_sobel(image im);
 image smooth_image(image im, float sigma);
+image make_1d_gaussian(float sigma);
 
 // Harris and Stitching
 point make_point(float x, float y);
 point project_point(matrix H, point p);
+float point_distance(point p, point q);
+homography matrix_to_homography(matrix H);
+matrix homography_to_matrix(homography h);
+homography identity_homography();
+homography homography_mult(homography a, homography b);
+homography homography_invert(homography a, int *ok);
+void project_points(homography h, const point *in, point *out, int n);
 matrix compute_homography(match *matches, int n);
 image structure_matrix(image im, float sigma);
 image cornerness_response(image S);
+image max_filter_image(image im, int w);
+image nms_image(image im, int w);
+peak *nms_peaks(image im, int w, float thresh, int *n);
+int peak_compare(const void *a, const void *b);
+int top_k_indices(const float *key, int n, int k, int *idx);
+peak *top_k_peaks(peak *p, int n, int k, int *kn);
+peak *anms_peaks(peak *p, int n, int k, float robust, int *kn);
 void free_descriptors(descriptor *d, int n);
+descriptor describe_index(image im, int i);
+void describe_index_into(image im, int i, float *out);
+descriptor_set make_descriptor_set(int n, int dim);
+void free_descriptor_set(descriptor_set s);
+descriptor_set descriptors_to_set(descriptor *d, int n);
+descriptor_set harris_corner_detector_set(image im, float sigma, float thresh, int nms);
+void set_feature_cache(const char *dir);
+unsigned long long image_hash(image im);
+descriptor *harris_corner_detector_cached(image im, float sigma, float thresh, int nms, int *n);
+match *match_descriptor_set(descriptor_set a, descriptor_set b, int *mn);
+knn2 *knn2_descriptor_set(descriptor_set a, descriptor_set b);
+match *match_descriptor_set_ratio(descriptor_set a, descriptor_set b, float ratio, int mutual, int *mn);
+match *match_descriptors_ratio(descriptor *a, int an, descriptor *b, int bn, float ratio, int mutual, int *mn);
+float l1_distance(float *a, float *b, int n);
 image cylindrical_project(image im, float f);
+image spherical_project(image im, float f);
+void free_projection_cache();
 void mark_corners(image im, descriptor *d, int n);
 image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms);
 void detect_and_draw_corners(image im, float sigma, float thresh, int nms);
 int model_inliers(matrix H, match *m, int n, float thresh);
+int homography_inliers(homography h, match *m, int n, float thresh);
+int homography_from_4(const match *m, homography *H);
+int homography_least_squares(const match *m, int n, homography *H);
+matrix RANSAC(match *m, int n, float thresh, int k, int cutoff);
+void ransac_sample_4(unsigned seed, int iter, int n, int idx[4]);
+matrix RANSAC_parallel(match *m, int n, float thresh, int k, int cutoff, unsigned seed);
+matrix RANSAC_prosac(match *m, int n, float thresh, int k, int cutoff, unsigned seed);
+match_soa make_match_soa(const match *m, int n);
+void free_match_soa(match_soa s);
+int homography_inlier_mask(homography h, match_soa s, float thresh, unsigned long long *mask);
+int compact_inliers(match *m, int n, const unsigned long long *mask);
+int ransac_iterations(float ratio, float confidence, int k);
+matrix RANSAC_adaptive(match *m, int n, float thresh, int k, float confidence, unsigned seed, int *iters);
 image combine_images(image a, image b, matrix H);
+image combine_images_blend(image a, image b, matrix H, int bands);
+int panorama_homographies(descriptor_set *s, int n, int ref, float inlier_thresh, int iters, int cutoff, homography *H, int *order);
+image render_panorama(image *ims, int n, homography *H, const int *order, int placed);
+image panorama_images(image *ims, int n, int ref, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff);
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn);
+int unique_matches(match *m, int n, int bn);
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n);
+descriptor *harris_corner_detector_budget(image im, float sigma, float thresh, int nms, int budget, int anms, int *n);
+descriptor *fast_corner_detector(image im, float thresh, int arc, int nms, int harris, int *n);
+float harris_score_at(image im, int x, int y, image g);
+descriptor *harris_corner_detector_grid(image im, float sigma, float thresh, int nms, int cols, int rows, int per_cell, int *n);
+descriptor *harris_corner_detector_stream(image im, float sigma, float thresh, int nms, int *n);
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff);
+image panorama_pipeline(char **paths, int n, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff, pipeline_times *times);
+void print_pipeline_times(pipeline_times t);
+
+// Approximate nearest neighbour indexes
+typedef struct kd_forest kd_forest;
+typedef struct lsh_index lsh_index;
+
+kd_forest *make_kd_forest(int dim, int trees);
+void free_kd_forest(kd_forest *f);
+void kd_forest_insert(kd_forest *f, descriptor_set s);
+int kd_forest_size(kd_forest *f);
+point kd_forest_point(kd_forest *f, int i);
+knn2 *kd_forest_knn2(kd_forest *f, descriptor_set q, int checks);
+match *match_kd_forest(descriptor_set a, kd_forest *f, int checks, int *mn);
+lsh_index *make_lsh_index(int tables, int bits);
+void free_lsh_index(lsh_index *l);
+void lsh_index_insert(lsh_index *l, binary_descriptor *d, int n);
+int lsh_index_size(lsh_index *l);
+point lsh_index_point(lsh_index *l, int i);
+knn2 *lsh_index_knn2(lsh_index *l, binary_descriptor *q, int n, int probes);
+match *match_lsh_index(binary_descriptor *a, int an, lsh_index *l, int probes, int *mn);
+
+// Binary descriptors
+void make_brief_pattern();
+binary_descriptor describe_binary_index(image im, int i);
+binary_descriptor *describe_binary_peaks(image im, peak *p, int n);
+binary_descriptor *harris_corner_detector_binary(image im, float sigma, float thresh, int nms, int *n);
+int hamming_distance(const binary_descriptor *a, const binary_descriptor *b);
+match *match_binary_descriptors(binary_descriptor *a, int an, binary_descriptor *b, int bn, int *mn);
+
+// Warping
+#define REMAP_BITS 15
+#define REMAP_ONE (1 << REMAP_BITS)
+
+// A precomputed inverse map from output pixels to source pixels.
+// int w, h: size of the output image.
+// int sw, sh: size of the source image the map samples from.
+// int *offset: index of the top-left bilinear tap in a source channel,
+//              -1 if the output pixel falls outside the source.
+// unsigned short *fx, *fy: fixed-point bilinear weights, REMAP_ONE == 1.
+typedef struct{
+    int w, h;
+    int sw, sh;
+    int *offset;
+    unsigned short *fx, *fy;
+} remap;
+
+remap make_remap(int w, int h, int sw, int sh);
+void free_remap(remap r);
+void set_remap_entry(remap r, int i, float x, float y);
+remap make_homography_remap(matrix H, int w, int h, int sw, int sh, float ox, float oy);
+remap make_cylindrical_remap(int w, int h, float f);
+remap make_spherical_remap(int w, int h, float f);
+remap make_field_remap(image field, int sw, int sh);
+void apply_remap_into(image im, remap r, image out);
+image apply_remap(image im, remap r);
+void bilinear_sample(image im, float x, float y, float *v);
+image pyramid_down(image im);
+void warp_homography_into(image src, homography H, image out, int ox, int oy, int x0, int y0, int x1, int y1);
 
 // Optical Flow
+// Image pyramid for optical flow, level 0 is full resolution.
+// int levels: number of levels.
+// image *im: grayscale levels, each half the size of the one before.
+// image *gx, *gy: gradients of each level.
+typedef struct{
+    int levels;
+    image *im;
+    image *gx, *gy;
+} flow_pyramid;
+
 image make_integral_image(image im);
 image box_filter_image(image im, int s);
 image time_structure_matrix(image im, image prev, int s);
 image velocity_image(image S, int stride);
 image optical_flow_images(image im, image prev, int smooth, int stride);
 void optical_flow_webcam(int smooth, int stride, int div);
+flow_pyramid make_flow_pyramid(image im, int levels);
+void free_flow_pyramid(flow_pyramid p);
+image pyramid_flow(flow_pyramid im, flow_pyramid prev, int win, int iters, int stride);
+image optical_flow_pyramid(image im, image prev, int levels, int win, int iters, int stride);
+void optical_flow_webcam_pyramid(int levels, int stride, int div);
 void draw_flow(image im, image v, float scale);
 
 #ifdef OPENCV
@@ -1,7 +1,10 @@
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
 #include <string.h>
 #include <assert.h>
+#include <dirent.h>
+#include <unistd.h>
 #include "matrix.h"
 #include "image.h"
 #include "test.h"
@@ -341,6 +344,26 @@ void test_bl_resize()
     free_image(gt2);
 }
 
+void test_bl_resize_batch()
+{
+    image im = load_image("data/dogsmall.jpg");
+    image ims[2] = {im, im};
+    image batch = bilinear_resize_batch(ims, 2, im.w*4, im.h*4);
+    image gt = load_image("figs/dog4x-bl.png");
+    image second = gt;
+    second.data = batch.data + gt.w*gt.h*gt.c;
+    TEST(batch.c == 2*im.c);
+    TEST(same_image(second, gt, EPS));
+
+    char *paths[2] = {"data/dogsmall.jpg", "data/dogsmall.jpg"};
+    image loaded = load_resize_batch(paths, 2, im.w*4, im.h*4, 3);
+    TEST(same_image(loaded, batch, EPS));
+    free_image(im);
+    free_image(batch);
+    free_image(loaded);
+    free_image(gt);
+}
+
 void test_multiple_resize()
 {
     image im = load_image("data/dog.jpg");
@@ -557,6 +580,317 @@ void test_cornerness()
 
 
 
+int point_compare(const void *a, const void *b)
+{
+    const descriptor *da = a;
+    const descriptor *db = b;
+    if (da->p.y != db->p.y) return da->p.y < db->p.y ? -1 : 1;
+    if (da->p.x != db->p.x) return da->p.x < db->p.x ? -1 : 1;
+    return 0;
+}
+
+int same_corners(descriptor *a, int an, descriptor *b, int bn)
+{
+    if (an != bn) {
+        printf("    Expected %d corners, got %d\n", bn, an);
+        return 0;
+    }
+    qsort(a, an, sizeof(descriptor), point_compare);
+    qsort(b, bn, sizeof(descriptor), point_compare);
+    int i;
+    for(i = 0; i < an; ++i){
+        if(!same_point(a[i].p, b[i].p, EPS)) return 0;
+    }
+    return 1;
+}
+
+void test_harris_stream()
+{
+    image im = load_image("data/dogsmall.jpg");
+    int an = 0, bn = 0;
+    descriptor *a = harris_corner_detector_stream(im, 2, .1, 3, &an);
+    descriptor *b = harris_corner_detector(im, 2, .1, 3, &bn);
+    TEST(an > 0);
+    TEST(same_corners(a, an, b, bn));
+    free_descriptors(a, an);
+    free_descriptors(b, bn);
+    free_image(im);
+}
+
+void test_nms()
+{
+    image im = make_image(37, 23, 1);
+    int i, j, m, n;
+    srand(3);
+    for(i = 0; i < im.w*im.h; ++i) im.data[i] = rand()%100;
+    image mx = max_filter_image(im, 4);
+    int same = 1;
+    for(j = 0; j < im.h; ++j){
+        for(i = 0; i < im.w; ++i){
+            float best = get_pixel(im, i, j, 0);
+            for(m = -4; m <= 4; ++m){
+                for(n = -4; n <= 4; ++n){
+                    best = MAX(best, get_pixel(im, i+n, j+m, 0));
+                }
+            }
+            if(best != get_pixel(mx, i, j, 0)) same = 0;
+        }
+    }
+    TEST(same);
+
+    image r = nms_image(im, 4);
+    int count = 0;
+    for(i = 0; i < r.w*r.h; ++i) if(r.data[i] > 50) ++count;
+    int pn = 0;
+    peak *p = nms_peaks(im, 4, 50, &pn);
+    TEST(pn > 0 && pn == count);
+    for(i = 0; i < pn; ++i){
+        if(get_pixel(r, p[i].p.x, p[i].p.y, 0) != p[i].v) same = 0;
+    }
+    TEST(same);
+    free(p);
+    free_image(r);
+    free_image(mx);
+    free_image(im);
+}
+
+void test_harris_grid()
+{
+    image im = load_image("data/dogsmall.jpg");
+    int an = 0, bn = 0;
+    descriptor *a = harris_corner_detector_grid(im, 2, .1, 3, 3, 2, 0, &an);
+    descriptor *b = harris_corner_detector(im, 2, .1, 3, &bn);
+    TEST(same_corners(a, an, b, bn));
+    free_descriptors(a, an);
+    a = harris_corner_detector_grid(im, 2, .1, 3, 3, 2, 4, &an);
+    TEST(an > 0 && an <= 3*2*4);
+    free_descriptors(a, an);
+    free_descriptors(b, bn);
+    free_image(im);
+}
+
+void test_fast()
+{
+    image im = make_image(40, 40, 3);
+    int i, j, k, n = 0;
+    for(k = 0; k < 3; ++k){
+        for(j = 10; j < 30; ++j){
+            for(i = 10; i < 30; ++i){
+                set_pixel(im, i, j, k, 1);
+            }
+        }
+    }
+    descriptor *d = fast_corner_detector(im, .2, 9, 3, 0, &n);
+    TEST(n == 4);
+    int near = 0;
+    for(i = 0; i < n; ++i){
+        float x = d[i].p.x < 20 ? 10 : 29;
+        float y = d[i].p.y < 20 ? 10 : 29;
+        near += fabs(d[i].p.x - x) <= 1 && fabs(d[i].p.y - y) <= 1;
+    }
+    TEST(near == n);
+    TEST(n && d[0].n == 5*5*3);
+    free_descriptors(d, n);
+    d = fast_corner_detector(im, .2, 9, 3, 1, &n);
+    TEST(n == 4);
+    free_descriptors(d, n);
+    free_image(im);
+}
+
+void test_corner_budget()
+{
+    int n = 500, i, kn = 0;
+    peak *p = calloc(n, sizeof(peak));
+    srand(5);
+    for(i = 0; i < n; ++i){
+        p[i].p = make_point(rand()%200, rand()%200);
+        p[i].v = rand()%10000;
+    }
+    peak *top = top_k_peaks(p, n, 20, &kn);
+    qsort(p, n, sizeof(peak), peak_compare);
+    int same = kn == 20;
+    for(i = 0; i < kn; ++i) if(top[i].v != p[i].v) same = 0;
+    TEST(same);
+    free(top);
+
+    peak *even = anms_peaks(p, n, 20, .9, &kn);
+    int strongest = 0;
+    for(i = 0; i < kn; ++i) if(even[i].v == p[0].v) strongest = 1;
+    TEST(kn == 20);
+    TEST(strongest);
+    free(even);
+    free(p);
+
+    image im = load_image("data/dogsmall.jpg");
+    descriptor *d = harris_corner_detector_budget(im, 2, .1, 3, 25, 1, &kn);
+    TEST(kn == 25);
+    free_descriptors(d, kn);
+    free_image(im);
+}
+
+void test_binary_descriptors()
+{
+    image im = load_image("data/dogsmall.jpg");
+    image shifted = make_image(im.w, im.h, im.c);
+    int i, j, k;
+    for(k = 0; k < im.c; ++k){
+        for(j = 0; j < im.h; ++j){
+            for(i = 0; i < im.w; ++i){
+                set_pixel(shifted, i, j, k, get_pixel(im, i+5, j+3, k));
+            }
+        }
+    }
+    int an = 0, bn = 0, mn = 0;
+    binary_descriptor *a = harris_corner_detector_binary(im, 2, .1, 3, &an);
+    binary_descriptor *b = harris_corner_detector_binary(shifted, 2, .1, 3, &bn);
+    TEST(hamming_distance(a, a) == 0);
+    match *m = match_binary_descriptors(a, an, b, bn, &mn);
+    int good = 0;
+    for(i = 0; i < mn; ++i){
+        if(same_point(m[i].q, make_point(m[i].p.x - 5, m[i].p.y - 3), EPS)) ++good;
+    }
+    TEST(mn > 0 && good > mn/2);
+    // The blocked search finds the same nearest distance as a plain scan.
+    int agree = 1;
+    for(i = 0; i < mn; ++i){
+        int best = BRIEF_BITS + 1;
+        for(j = 0; j < bn; ++j) best = MIN(best, hamming_distance(a + m[i].ai, b + j));
+        if(m[i].distance != best || hamming_distance(a + m[i].ai, b + m[i].bi) != best) agree = 0;
+    }
+    TEST(agree);
+    free(a);
+    free(b);
+    free(m);
+    free_image(shifted);
+    free_image(im);
+}
+
+void test_descriptor_set()
+{
+    image im = load_image("data/dogsmall.jpg");
+    int n = 0, mn = 0, i;
+    descriptor *d = harris_corner_detector(im, 2, .1, 3, &n);
+    descriptor_set s = harris_corner_detector_set(im, 2, .1, 3);
+    TEST(s.n == n && s.dim == d[0].n && s.stride % 8 == 0);
+    TEST(((size_t)s.data & 63) == 0);
+    int same = 1;
+    for(i = 0; i < n; ++i){
+        if(!same_point(d[i].p, make_point(s.x[i], s.y[i]), EPS)) same = 0;
+        if(memcmp(d[i].data, s.data + i*s.stride, s.dim*sizeof(float))) same = 0;
+    }
+    TEST(same);
+
+    descriptor_set t = descriptors_to_set(d, n);
+    match *m = match_descriptor_set(s, t, &mn);
+    int exact = 0;
+    for(i = 0; i < mn; ++i) if(m[i].distance == 0) ++exact;
+    TEST(mn > 0 && exact == mn);
+    free(m);
+    free_descriptor_set(s);
+    free_descriptor_set(t);
+    free_descriptors(d, n);
+    free_image(im);
+}
+
+void test_knn2()
+{
+    descriptor_set a = make_descriptor_set(70, 11);
+    descriptor_set b = make_descriptor_set(600, 11);
+    int i, j, k;
+    srand(7);
+    for(i = 0; i < a.n; ++i) for(k = 0; k < a.dim; ++k) a.data[i*a.stride + k] = rand()%1000/1000.;
+    for(i = 0; i < b.n; ++i) for(k = 0; k < b.dim; ++k) b.data[i*b.stride + k] = rand()%1000/1000.;
+    knn2 *r = knn2_descriptor_set(a, b);
+    int same = 1;
+    for(i = 0; i < a.n; ++i){
+        float d1 = FLT_MAX, d2 = FLT_MAX;
+        int b1 = -1;
+        for(j = 0; j < b.n; ++j){
+            float d = l1_distance(a.data + i*a.stride, b.data + j*b.stride, a.dim);
+            if(d < d1){ d2 = d1; d1 = d; b1 = j; }
+            else if(d < d2) d2 = d;
+        }
+        if(r[i].best != b1 || !within_eps(r[i].d1, d1, EPS) || !within_eps(r[i].d2, d2, EPS)) same = 0;
+    }
+    TEST(same);
+    free(r);
+    free_descriptor_set(a);
+    free_descriptor_set(b);
+}
+
+void test_ann_index()
+{
+    image im = load_image("data/dogsmall.jpg");
+    descriptor_set s = harris_corner_detector_set(im, 2, .1, 3);
+    descriptor_set half = s;
+    half.n = s.n/2;
+    descriptor_set rest = s;
+    rest.n = s.n - half.n;
+    rest.data = s.data + half.n*s.stride;
+    rest.x = s.x + half.n;
+    rest.y = s.y + half.n;
+    kd_forest *f = make_kd_forest(s.dim, 4);
+    kd_forest_insert(f, half);
+    kd_forest_insert(f, rest);
+    TEST(kd_forest_size(f) == s.n);
+    image other = load_image("data/dog_b_small.jpg");
+    descriptor_set q = harris_corner_detector_set(other, 2, .1, 3);
+    knn2 *exact = knn2_descriptor_set(q, s);
+    knn2 *approx = kd_forest_knn2(f, q, 256);
+    int i, found = 0;
+    for(i = 0; i < q.n; ++i) if(within_eps(exact[i].d1, approx[i].d1, EPS)) ++found;
+    TEST(found > q.n/2);
+    free(approx);
+    free(exact);
+    free_descriptor_set(q);
+    free_image(other);
+    free_kd_forest(f);
+
+    int bn = 0;
+    binary_descriptor *b = harris_corner_detector_binary(im, 2, .1, 3, &bn);
+    lsh_index *l = make_lsh_index(8, 12);
+    lsh_index_insert(l, b, bn);
+    knn2 *r = lsh_index_knn2(l, b, bn, 2);
+    found = 0;
+    for(i = 0; i < bn; ++i) if(r[i].d1 == 0) ++found;
+    TEST(lsh_index_size(l) == bn && found == bn);
+    free(r);
+    free_lsh_index(l);
+    free(b);
+    free_descriptor_set(s);
+    free_image(im);
+}
+
+void test_ratio_matching()
+{
+    image im = load_image("data/dogsmall.jpg");
+    image shifted = make_image(im.w, im.h, im.c);
+    int i, j, k;
+    for(k = 0; k < im.c; ++k){
+        for(j = 0; j < im.h; ++j){
+            for(i = 0; i < im.w; ++i){
+                set_pixel(shifted, i, j, k, get_pixel(im, i+5, j+3, k));
+            }
+        }
+    }
+    int an = 0, bn = 0, mn = 0, rn = 0;
+    descriptor *a = harris_corner_detector(im, 2, .1, 3, &an);
+    descriptor *b = harris_corner_detector(shifted, 2, .1, 3, &bn);
+    match *m = match_descriptors(a, an, b, bn, &mn);
+    match *r = match_descriptors_ratio(a, an, b, bn, .8, 1, &rn);
+    int good = 0, rgood = 0;
+    for(i = 0; i < mn; ++i) good += same_point(m[i].q, make_point(m[i].p.x - 5, m[i].p.y - 3), EPS);
+    for(i = 0; i < rn; ++i) rgood += same_point(r[i].q, make_point(r[i].p.x - 5, r[i].p.y - 3), EPS);
+    TEST(rn > 0 && rn <= mn);
+    TEST((float)rgood/rn >= (float)good/mn);
+    free(m);
+    free(r);
+    free_descriptors(a, an);
+    free_descriptors(b, bn);
+    free_image(shifted);
+    free_image(im);
+}
+
 void test_projection()
 {
     matrix H = make_translation_homography(12.4, -3.2);
@@ -575,6 +909,23 @@ void test_projection()
     H.data[2][2] = .112;
     point p = project_point(H, make_point(3.14, 1.59));
     TEST(same_point(p, make_point(-0.66544, 0.326017), EPS));
+
+    homography h = matrix_to_homography(H);
+    TEST(same_point(project_point_h(h, make_point(3.14, 1.59)), p, EPS));
+    point in[3] = {{3.14, 1.59}, {0, 0}, {-2, 7}};
+    point out[3];
+    project_points(h, in, out, 3);
+    TEST(same_point(out[0], p, EPS) && same_point(out[2], project_point(H, in[2]), EPS));
+
+    int ok = 0;
+    homography hi = homography_invert(h, &ok);
+    TEST(ok && same_point(project_point_h(hi, p), in[0], EPS));
+    matrix back = homography_to_matrix(homography_mult(hi, h));
+    scale_matrix(back, 1/back.data[2][2]);
+    matrix I = make_identity_homography();
+    TEST(same_matrix(back, I));
+    free_matrix(back);
+    free_matrix(I);
     free_matrix(H);
 }
 
@@ -614,6 +965,496 @@ void test_compute_homography()
     free(m);
 }
 
+void test_homography_solvers()
+{
+    homography T = {{1.1, .05, 12, -.03, .95, -7, .0004, -.0002, 1}};
+    match *m = calloc(40, sizeof(match));
+    for (int i = 0; i < 40; i++) {
+        m[i].p = make_point((i*37)%200, (i*i*29 + 7*i)%150);
+        m[i].q = project_point_h(T, m[i].p);
+    }
+    homography H;
+    TEST(homography_from_4(m, &H));
+    matrix A = homography_to_matrix(H);
+    matrix B = homography_to_matrix(T);
+    TEST(same_matrix(A, B));
+    free_matrix(A);
+
+    TEST(homography_least_squares(m, 40, &H));
+    A = homography_to_matrix(H);
+    TEST(same_matrix(A, B));
+    free_matrix(A);
+
+    // Collinear points don't determine a homography.
+    match c[4];
+    for (int i = 0; i < 4; i++) {
+        c[i].p = make_point(i, 2*i);
+        c[i].q = make_point(i + 1, 2*i + 1);
+    }
+    TEST(!homography_from_4(c, &H));
+    TEST(!homography_least_squares(m, 3, &H));
+
+    // Every fifth match is an outlier, RANSAC should ignore them.
+    for (int i = 0; i < 40; i += 5) m[i].q.x += 50;
+    srand(1);
+    A = RANSAC(m, 40, 1, 200, 40);
+    TEST(A.data && same_matrix(A, B));
+    TEST(model_inliers(A, m, 40, 1) == 32);
+    free_matrix(A);
+    free_matrix(B);
+    free(m);
+}
+
+void test_ransac_parallel()
+{
+    homography T = {{.9, -.1, -20, .08, 1.05, 15, -.0003, .0005, 1}};
+    int n = 200;
+    match *m = calloc(n, sizeof(match));
+    for (int i = 0; i < n; i++) {
+        m[i].p = make_point((i*37)%300, (i*i*29 + 7*i)%250);
+        m[i].q = project_point_h(T, m[i].p);
+        // Two thirds of the matches are outliers.
+        if (i%3) m[i].q = make_point((i*71)%300, (i*113)%250);
+    }
+    match *c = calloc(n, sizeof(match));
+    memcpy(c, m, n*sizeof(match));
+
+    int idx[4];
+    ransac_sample_4(7, 123, 5, idx);
+    TEST(idx[0] != idx[1] && idx[0] != idx[2] && idx[0] != idx[3] &&
+         idx[1] != idx[2] && idx[1] != idx[3] && idx[2] != idx[3]);
+    // Rejection-heavy draws, even at large hypothesis numbers, still give
+    // every ordering of 4 matches.
+    int seen[256] = {0}, orders = 0;
+    for (int i = 0; i < 2000; i++) {
+        ransac_sample_4(7, (1 << 29) + i, 4, idx);
+        int key = idx[0] | idx[1] << 2 | idx[2] << 4 | idx[3] << 6;
+        orders += !seen[key];
+        seen[key] = 1;
+    }
+    TEST(orders == 24);
+
+    matrix B = homography_to_matrix(T);
+    matrix A = RANSAC_parallel(m, n, 1, 2000, n, 7);
+    TEST(A.data && same_matrix(A, B));
+    TEST(model_inliers(A, m, n, 1) == (n + 2)/3);
+
+    // Same seed, same answer, and the cutoff stops it early.
+    matrix A2 = RANSAC_parallel(c, n, 1, 2000, n, 7);
+    TEST(A2.data && same_matrix(A, A2));
+    matrix A3 = RANSAC_parallel(c, n, 1, 1000000, 10, 7);
+    TEST(A3.data && same_matrix(A3, B));
+    free_matrix(A);
+    free_matrix(A2);
+    free_matrix(A3);
+    free_matrix(B);
+    free(m);
+    free(c);
+}
+
+void test_ransac_prosac()
+{
+    homography T = {{.9, -.1, -20, .08, 1.05, 15, -.0003, .0005, 1}};
+    int n = 300;
+    match *m = calloc(n, sizeof(match));
+    for (int i = 0; i < n; i++) {
+        m[i].p = make_point((i*37)%300, (i*i*29 + 7*i)%250);
+        m[i].q = project_point_h(T, m[i].p);
+        // Only the 20 best ranked matches and a few others are correct.
+        if (i >= 20 && i%10) m[i].q = make_point((i*71)%300, (i*113)%250);
+    }
+    // Uniform sampling would need thousands of iterations here.
+    matrix B = homography_to_matrix(T);
+    matrix A = RANSAC_prosac(m, n, 1, 50, n, 3);
+    TEST(A.data && same_matrix(A, B));
+    TEST(model_inliers(A, m, n, 1) == 20 + 28);
+    free_matrix(A);
+    free_matrix(B);
+    free(m);
+}
+
+void test_ransac_adaptive()
+{
+    TEST(ransac_iterations(.5, .99, 100000) == 72);
+    TEST(ransac_iterations(.01, .99, 1000) == 1000);
+    TEST(ransac_iterations(1, .99, 1000) == 1);
+
+    homography T = {{.9, -.1, -20, .08, 1.05, 15, -.0003, .0005, 1}};
+    int n = 300;
+    match *m = calloc(n, sizeof(match));
+    for (int i = 0; i < n; i++) {
+        m[i].p = make_point((i*37)%300, (i*i*29 + 7*i)%250);
+        m[i].q = project_point_h(T, m[i].p);
+        if (i%2) m[i].q = make_point((i*71)%300, (i*113)%250);
+    }
+    int iters = 0;
+    matrix B = homography_to_matrix(T);
+    matrix A = RANSAC_adaptive(m, n, 1, 50000, .99, 5, &iters);
+    TEST(A.data && same_matrix(A, B));
+    TEST(model_inliers(A, m, n, 1) == n/2);
+    // Half inliers needs about 72 iterations, not 50000.
+    TEST(iters > 0 && iters < 500);
+    free_matrix(A);
+    free_matrix(B);
+    free(m);
+}
+
+void test_inlier_mask()
+{
+    homography T = {{.9, -.1, -20, .08, 1.05, 15, -.0003, .0005, 1}};
+    int n = 150;
+    match *m = calloc(n, sizeof(match));
+    for (int i = 0; i < n; i++) {
+        m[i].p = make_point((i*37)%300, (i*i*29 + 7*i)%250);
+        m[i].q = project_point_h(T, m[i].p);
+        if (i%3 == 1) m[i].q = make_point((i*71)%300, (i*113)%250);
+        if (i%3 == 2) m[i].q.x += .4*(i%4);
+    }
+    match_soa s = make_match_soa(m, n);
+    unsigned long long mask[3];
+    int count = homography_inlier_mask(T, s, 1, mask);
+    int same = 1;
+    for (int i = 0; i < n; i++) {
+        int in = point_distance(project_point_h(T, m[i].p), m[i].q) < 1;
+        same &= in == (int)(mask[i/64] >> (i%64) & 1);
+    }
+    TEST(same);
+    TEST(compact_inliers(m, n, mask) == count);
+    matrix H = homography_to_matrix(T);
+    TEST(count == model_inliers(H, m, n, 1));
+    free_matrix(H);
+    free_match_soa(s);
+    free(m);
+}
+
+void test_panorama_images()
+{
+    image im = load_image("data/dog.jpg");
+    int w = im.w*.5;
+    image ims[3];
+    ims[0] = crop_image(im, im.w/4, 0, w, im.h);
+    ims[1] = crop_image(im, im.w - w, 0, w, im.h);
+    ims[2] = crop_image(im, 0, 0, w, im.h);
+
+    descriptor_set s[3];
+    for (int i = 0; i < 3; i++) s[i] = harris_corner_detector_set(ims[i], 2, 5, 3);
+    homography H[3];
+    int order[3];
+    TEST(panorama_homographies(s, 3, 0, 2, 1000, 50, H, order) == 3);
+    TEST(order[0] == 0);
+    TEST(fabs(H[1].h[2] - (im.w - w - im.w/4)) < .5 && fabs(H[1].h[5]) < .5);
+    TEST(fabs(H[2].h[2] + im.w/4) < .5 && fabs(H[2].h[5]) < .5);
+
+    // Only images within MOSAIC_NEIGHBOURS in input order are matched.
+    image blank = make_image(w, im.h, im.c);
+    descriptor_set none = harris_corner_detector_set(blank, 2, 5, 3);
+    descriptor_set far[4] = {s[0], none, none, s[1]};
+    homography Hf[4];
+    int of[4];
+    TEST(panorama_homographies(far, 4, 0, 2, 1000, 50, Hf, of) == 1);
+    free_descriptor_set(none);
+    free_image(blank);
+
+    image pan = render_panorama(ims, 3, H, order, 3);
+    TEST(abs(pan.w - im.w) <= 2 && abs(pan.h - im.h) <= 2);
+    TEST(within_eps(get_pixel(pan, 10, im.h/2, 1), get_pixel(im, 10, im.h/2, 1), .05));
+    TEST(within_eps(get_pixel(pan, im.w - 10, im.h/2, 0), get_pixel(im, im.w - 10, im.h/2, 0), .05));
+
+    // An image with a singular homography is left out, and with only the
+    // reference left the panorama is a copy of it.
+    int left[2] = {order[0], order[1] == 1 ? order[2] : order[1]};
+    image without = render_panorama(ims, 3, H, left, 2);
+    homography singular = {{1, 0, 0, 1, 0, 0, 0, 0, 1}};
+    H[1] = singular;
+    image skipped = render_panorama(ims, 3, H, order, 3);
+    TEST(skipped.w == without.w && skipped.h == without.h && skipped.c == without.c);
+    TEST(!memcmp(skipped.data, without.data, skipped.w*skipped.h*skipped.c*sizeof(float)));
+    H[2] = singular;
+    image alone = render_panorama(ims, 3, H, order, 3);
+    TEST(alone.w == ims[0].w && alone.h == ims[0].h && same_image(alone, ims[0], EPS));
+    free_image(without);
+    free_image(skipped);
+    free_image(alone);
+    for (int i = 0; i < 3; i++) {
+        free_descriptor_set(s[i]);
+        free_image(ims[i]);
+    }
+    free_image(pan);
+    free_image(im);
+}
+
+void test_combine_images()
+{
+    image a = load_image("data/dogsmall.jpg");
+    image b = copy_image(a);
+    matrix H = make_translation_homography(-20, 10);
+    image c = combine_images(a, b, H);
+    TEST(c.w == a.w + 20 && c.h == a.h + 10);
+    TEST(within_eps(get_pixel(c, 5, 15, 1), get_pixel(a, 5, 5, 1), EPS));
+    TEST(within_eps(get_pixel(c, c.w - 1, 0, 2), get_pixel(b, b.w - 1, 0, 2), EPS));
+    TEST(within_eps(get_pixel(c, 30, 2, 0), get_pixel(b, 10, 2, 0), EPS));
+    free_matrix(H);
+    free_image(c);
+
+    // A singular homography leaves a alone.
+    H = make_matrix(3, 3);
+    H.data[0][0] = H.data[1][0] = H.data[2][2] = 1;
+    c = combine_images(a, b, H);
+    TEST(c.w == a.w && c.h == a.h && same_image(c, a, EPS));
+    free_image(c);
+    c = combine_images_blend(a, b, H, 4);
+    TEST(c.w == a.w && c.h == a.h);
+    free_matrix(H);
+    free_image(c);
+
+    // The clipped scanlines cover exactly the pixels that project into b.
+    homography P = {{.9, .2, 5, -.1, 1.1, -8, .001, .0005, 1}};
+    image out = make_image(2*a.w, 2*a.h, a.c);
+    warp_homography_into(b, P, out, -10, -10, 0, 0, out.w, out.h);
+    int same = 1;
+    float v[3];
+    for (int j = 0; j < out.h; j++) {
+        for (int i = 0; i < out.w; i++) {
+            point p = project_point_h(P, make_point(i - 10, j - 10));
+            // Rounding decides pixels right on the border either way.
+            float e = MIN(MIN(fabs(p.x), fabs(p.y)), MIN(fabs(p.x - b.w), fabs(p.y - b.h)));
+            if (e < .01) continue;
+            int in = p.x >= 0 && p.y >= 0 && p.x < b.w && p.y < b.h;
+            if (in) bilinear_sample(b, p.x, p.y, v);
+            for (int k = 0; k < 3; k++) same &= fabs(get_pixel(out, i, j, k) - (in ? v[k] : 0)) < 1e-3;
+        }
+    }
+    TEST(same);
+    free_image(out);
+    free_image(a);
+    free_image(b);
+
+    // Blank images have no matches, panorama_image gives back a.
+    a = make_image(64, 64, 3);
+    b = make_image(64, 64, 3);
+    c = panorama_image(a, b, 2, 5, 3, 2, 1000, 30);
+    TEST(c.w == a.w && c.h == a.h);
+    free_image(c);
+    free_image(a);
+    free_image(b);
+}
+
+void test_blend_images()
+{
+    image a = make_image(300, 100, 3);
+    image b = make_image(300, 100, 3);
+    for (int i = 0; i < a.w*a.h*a.c; i++) {
+        a.data[i] = .2;
+        b.data[i] = .6;
+    }
+    matrix H = make_translation_homography(-150, 0);
+    for (int bands = 0; bands <= 5; bands += 5) {
+        image c = combine_images_blend(a, b, H, bands);
+        TEST(c.w == 450 && c.h == 100);
+        // The seam is spread out instead of one .4 jump.
+        float jump = 0;
+        for (int x = 1; x < c.w; x++) {
+            jump = MAX(jump, fabs(get_pixel(c, x, 50, 1) - get_pixel(c, x - 1, 50, 1)));
+        }
+        TEST(jump < .1);
+        TEST(within_eps(get_pixel(c, 10, 50, 0), .2, EPS) && within_eps(get_pixel(c, 440, 50, 2), .6, EPS));
+        free_image(c);
+    }
+    free_matrix(H);
+    free_image(a);
+    free_image(b);
+
+    // Consistent images blend back to themselves.
+    image im = load_image("data/dogsmall.jpg");
+    a = crop_image(im, 0, 0, 120, im.h);
+    b = crop_image(im, 60, 0, im.w - 60, im.h);
+    H = make_translation_homography(-60, 0);
+    image c = combine_images_blend(a, b, H, 4);
+    float err = 0;
+    for (int y = 0; y < im.h; y++) {
+        for (int x = 0; x < im.w; x++) err = MAX(err, fabs(get_pixel(c, x, y, 1) - get_pixel(im, x, y, 1)));
+    }
+    TEST(err < .01);
+    free_matrix(H);
+    free_image(c);
+    free_image(a);
+    free_image(b);
+    free_image(im);
+}
+
+void test_feature_cache()
+{
+    image im = load_image("data/dogsmall.jpg");
+    image other = copy_image(im);
+    TEST(image_hash(im) == image_hash(other));
+    other.data[17] += .01;
+    TEST(image_hash(im) != image_hash(other));
+
+    char dir[] = "/tmp/uwimg_cacheXXXXXX";
+    TEST(mkdtemp(dir) != 0);
+    set_feature_cache(dir);
+    int n0 = 0, n1 = 0, n2 = 0;
+    descriptor *d0 = harris_corner_detector(im, 2, 5, 3, &n0);
+    descriptor *d1 = harris_corner_detector_cached(im, 2, 5, 3, &n1);
+    descriptor *d2 = harris_corner_detector_cached(im, 2, 5, 3, &n2);
+    int same = n0 > 0 && n0 == n1 && n1 == n2;
+    for (int i = 0; same && i < n0; i++) {
+        same &= same_point(d0[i].p, d2[i].p, EPS) && d0[i].n == d2[i].n;
+        same &= memcmp(d0[i].data, d2[i].data, d0[i].n*sizeof(float)) == 0;
+    }
+    TEST(same);
+
+    // The first cached call left exactly one cache file.
+    char file[512] = "";
+    int files = 0;
+    DIR *dp = opendir(dir);
+    for (struct dirent *e = dp ? readdir(dp) : 0; e; e = readdir(dp)) {
+        if (e->d_name[0] == '.') continue;
+        files++;
+        if (strstr(e->d_name, ".feat")) snprintf(file, sizeof(file), "%s/%s", dir, e->d_name);
+    }
+    if (dp) closedir(dp);
+    TEST(files == 1 && file[0]);
+
+    // Later calls read the file: an edit to its last descriptor value shows
+    // up, and a truncated file is ignored in favour of detecting again.
+    int n3 = 0, n4 = 0;
+    float mark = 12345;
+    FILE *fp = fopen(file, "r+b");
+    if (fp) {
+        fseek(fp, -(long)sizeof(float), SEEK_END);
+        fwrite(&mark, sizeof(float), 1, fp);
+        fclose(fp);
+    }
+    descriptor *d3 = harris_corner_detector_cached(im, 2, 5, 3, &n3);
+    TEST(n3 == n0 && d3[n3-1].data[d3[n3-1].n-1] == mark);
+    fp = fopen(file, "r+b");
+    if (fp) {
+        fseek(fp, 0, SEEK_END);
+        TEST(ftruncate(fileno(fp), ftell(fp) - 1) == 0);
+        fclose(fp);
+    }
+    descriptor *d4 = harris_corner_detector_cached(im, 2, 5, 3, &n4);
+    TEST(n4 == n0 && d4[n4-1].data[d4[n4-1].n-1] == d0[n0-1].data[d0[n0-1].n-1]);
+    set_feature_cache(0);
+    free_descriptors(d3, n3);
+    free_descriptors(d4, n4);
+
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    TEST(system(cmd) == 0);
+    free_descriptors(d0, n0);
+    free_descriptors(d1, n1);
+    free_descriptors(d2, n2);
+    free_image(other);
+    free_image(im);
+}
+
+void test_panorama_pipeline()
+{
+    image im = load_image("data/dog.jpg");
+    int w = im.w*.5;
+    int x[3] = {0, im.w/4, im.w - w};
+    char dir[] = "/tmp/uwimg_pipeXXXXXX";
+    TEST(mkdtemp(dir) != 0);
+    char names[3][64], files[3][64];
+    char *paths[3];
+    for (int i = 0; i < 3; i++) {
+        image crop = crop_image(im, x[i], 0, w, im.h);
+        snprintf(names[i], sizeof(names[i]), "%s/%d", dir, i);
+        snprintf(files[i], sizeof(files[i]), "%s.png", names[i]);
+        save_png(crop, names[i]);
+        paths[i] = files[i];
+        free_image(crop);
+    }
+
+    pipeline_times t;
+    image pan = panorama_pipeline(paths, 3, 2, 5, 3, 2, 1000, 50, &t);
+    TEST(abs(pan.w - im.w) <= 2 && abs(pan.h - im.h) <= 2);
+    TEST(within_eps(get_pixel(pan, 10, im.h/2, 1), get_pixel(im, 10, im.h/2, 1), .05));
+    TEST(within_eps(get_pixel(pan, im.w - 10, im.h/2, 0), get_pixel(im, im.w - 10, im.h/2, 0), .05));
+    int timed = t.wall > 0;
+    for (int i = 0; i < PIPE_STAGES; i++) timed &= t.stage[i] > 0;
+    TEST(timed);
+
+    // Out of order, the first pair does not overlap and the chain stops there.
+    paths[1] = paths[2];
+    paths[2] = files[1];
+    image part = panorama_pipeline(paths, 3, 2, 5, 3, 2, 1000, 50, 0);
+    TEST(part.w == w && part.h == im.h);
+
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    TEST(system(cmd) == 0);
+    free_image(part);
+    free_image(pan);
+    free_image(im);
+}
+
+void test_remap()
+{
+    image im = load_image("data/dogsmall.jpg");
+    matrix H = make_translation_homography(3, 2);
+    remap r = make_homography_remap(H, im.w, im.h, im.w, im.h, 0, 0);
+    image warped = apply_remap(im, r);
+    TEST(within_eps(get_pixel(warped, 10, 20, 1), get_pixel(im, 13, 22, 1), EPS));
+    TEST(within_eps(get_pixel(warped, im.w-4, im.h-3, 2), get_pixel(im, im.w-1, im.h-1, 2), EPS));
+    TEST(r.offset[(im.h-1)*im.w + im.w-1] == -1);
+    free_matrix(H);
+    free_remap(r);
+    free_image(warped);
+
+    image field = make_image(im.w, im.h, 2);
+    int i, j;
+    for(j = 0; j < im.h; ++j){
+        for(i = 0; i < im.w; ++i){
+            set_pixel(field, i, j, 0, i + .5);
+            set_pixel(field, i, j, 1, j);
+        }
+    }
+    r = make_field_remap(field, im.w, im.h);
+    warped = apply_remap(im, r);
+    TEST(within_eps(get_pixel(warped, 7, 9, 0), (get_pixel(im, 7, 9, 0) + get_pixel(im, 8, 9, 0))/2, EPS));
+    free_remap(r);
+    free_image(warped);
+    free_image(field);
+
+    image cyl = cylindrical_project(im, 1e6);
+    TEST(same_image(cyl, im, EPS));
+    free_image(cyl);
+
+    // Cached tables give the same result as building them fresh.
+    for (int kind = 0; kind < 2; kind++) {
+        r = kind ? make_spherical_remap(im.w, im.h, 150) : make_cylindrical_remap(im.w, im.h, 150);
+        image fresh = apply_remap(im, r);
+        image first = kind ? spherical_project(im, 150) : cylindrical_project(im, 150);
+        image again = kind ? spherical_project(im, 150) : cylindrical_project(im, 150);
+        TEST(same_image(first, fresh, EPS) && same_image(again, fresh, EPS));
+        free_image(fresh);
+        free_image(first);
+        free_image(again);
+        free_remap(r);
+    }
+
+    // Concurrent projections with more sizes than the cache holds, so
+    // tables get evicted while other threads may still be using them.
+    int ok = 1;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(&:ok)
+    for (int t = 0; t < 24; t++) {
+        float f = 100 + 10*(t%12);
+        remap fr = make_cylindrical_remap(im.w, im.h, f);
+        image fresh = apply_remap(im, fr);
+        image cached = cylindrical_project(im, f);
+        ok &= same_image(cached, fresh, EPS);
+        free_image(fresh);
+        free_image(cached);
+        free_remap(fr);
+    }
+    TEST(ok);
+    free_projection_cache();
+    free_image(im);
+}
+
 void test_activate_matrix()
 {
     matrix a = load_matrix("data/test/a.matrix");
@@ -821,6 +1662,7 @@ void test_hw1()
     test_nn_resize();
     test_bl_interpolate();
     test_bl_resize();
+    test_bl_resize_batch();
     test_multiple_resize();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
@@ -841,8 +1683,29 @@ void test_hw3()
 {
     test_structure();
     test_cornerness();
+    test_nms();
+    test_harris_stream();
+    test_harris_grid();
+    test_fast();
+    test_corner_budget();
+    test_binary_descriptors();
+    test_descriptor_set();
+    test_knn2();
+    test_ann_index();
+    test_ratio_matching();
     test_projection();
     test_compute_homography();
+    test_homography_solvers();
+    test_ransac_parallel();
+    test_ransac_prosac();
+    test_ransac_adaptive();
+    test_inlier_mask();
+    test_panorama_images();
+    test_combine_images();
+    test_blend_images();
+    test_feature_cache();
+    test_panorama_pipeline();
+    test_remap();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void make_hw4_tests()
@@ -947,6 +1810,40 @@ void test_velocity_image()
     free_image(velocity);
     free_image(velocity_t);
 }
+void test_pyramid_flow()
+{
+    image dog = load_image("data/dog.jpg");
+    int w = dog.w - 40, h = dog.h - 40;
+    // Content moves by (9, -6) from prev to im.
+    image prev = crop_image(dog, 20, 20, w, h);
+    image im = crop_image(dog, 20 - 9, 20 + 6, w, h);
+
+    image v = optical_flow_pyramid(im, prev, 4, 9, 3, 4);
+    TEST(v.w == w/4 && v.h == h/4);
+    int good = 0, total = 0;
+    for (int j = v.h/4; j < 3*v.h/4; j++) {
+        for (int i = v.w/4; i < 3*v.w/4; i++) {
+            good += fabs(get_pixel(v, i, j, 0) - 9) < .5 && fabs(get_pixel(v, i, j, 1) + 6) < .5;
+            total++;
+        }
+    }
+    TEST(good > .9*total);
+
+    // Pyramids built once give the same flow.
+    flow_pyramid a = make_flow_pyramid(im, 4);
+    flow_pyramid b = make_flow_pyramid(prev, 4);
+    TEST(a.levels == 4 && a.im[3].w == (((w + 1)/2 + 1)/2 + 1)/2);
+    image v2 = pyramid_flow(a, b, 9, 3, 4);
+    TEST(v.w == v2.w && v.h == v2.h && !memcmp(v.data, v2.data, v.w*v.h*v.c*sizeof(float)));
+
+    free_flow_pyramid(a);
+    free_flow_pyramid(b);
+    free_image(v2);
+    free_image(v);
+    free_image(im);
+    free_image(prev);
+    free_image(dog);
+}
 void test_hw4()
 {
     test_integral_image();
@@ -954,6 +1851,7 @@ void test_hw4()
     test_good_enough_box_filter_image();
     test_structure_image();
     test_velocity_image();
+    test_pyramid_flow();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw5()
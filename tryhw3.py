@@ -35,6 +35,11 @@ def rainier_panorama():
     pan5 = panorama_image(pan4, im4, thresh=5)
     save_image(pan5, "rainier_panorama_5")
 
+def rainier_panorama_all():
+    ims = [load_image("data/Rainier%d.png" % i) for i in range(1, 7)]
+    pan = panorama_images(ims, ref=0, thresh=5)
+    save_image(pan, "rainier_panorama_all")
+
 
 def field_panorama():
     im1 = load_image("data/field1.jpg")
@@ -71,5 +76,6 @@ def field_panorama():
 #draw_matches()
 #easy_panorama()
 #rainier_panorama()
+#rainier_panorama_all()
 field_panorama()
 
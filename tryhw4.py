@@ -6,4 +6,8 @@ from uwimg import *
 # draw_flow(a, flow, 8)
 # save_image(a, "lines")
 
+# Pyramidal Lucas-Kanade follows larger motions without heavy smoothing
+# flow = optical_flow_pyramid(b, a, 4, 9, 3, 8)
+# optical_flow_webcam_pyramid(4, 4, 4)
+
 optical_flow_webcam(15,4,8)
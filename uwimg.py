@@ -29,6 +29,13 @@ class DESCRIPTOR(Structure):
                 ("n", c_int),
                 ("data", POINTER(c_float))]
 
+class MATCH(Structure):
+    _fields_ = [("p", POINT),
+                ("q", POINT),
+                ("ai", c_int),
+                ("bi", c_int),
+                ("distance", c_float)]
+
 class MATRIX(Structure):
     _fields_ = [("rows", c_int),
                 ("cols", c_int),
@@ -143,6 +150,20 @@ bilinear_resize = lib.bilinear_resize
 bilinear_resize.argtypes = [IMAGE, c_int, c_int]
 bilinear_resize.restype = IMAGE
 
+bilinear_resize_batch_lib = lib.bilinear_resize_batch
+bilinear_resize_batch_lib.argtypes = [POINTER(IMAGE), c_int, c_int, c_int]
+bilinear_resize_batch_lib.restype = IMAGE
+
+def bilinear_resize_batch(ims, w, h):
+    return bilinear_resize_batch_lib(c_array(IMAGE, ims), len(ims), w, h)
+
+load_resize_batch_lib = lib.load_resize_batch
+load_resize_batch_lib.argtypes = [POINTER(c_char_p), c_int, c_int, c_int, c_int]
+load_resize_batch_lib.restype = IMAGE
+
+def load_resize_batch(paths, w, h, c=3):
+    return load_resize_batch_lib(c_array(c_char_p, [p.encode('ascii') for p in paths]), len(paths), w, h, c)
+
 make_sharpen_filter = lib.make_sharpen_filter
 make_sharpen_filter.argtypes = []
 make_sharpen_filter.restype = IMAGE
@@ -187,6 +208,26 @@ harris_corner_detector = lib.harris_corner_detector
 harris_corner_detector.argtypes = [IMAGE, c_float, c_float, c_int, POINTER(c_int)]
 harris_corner_detector.restype = POINTER(DESCRIPTOR)
 
+harris_corner_detector_budget = lib.harris_corner_detector_budget
+harris_corner_detector_budget.argtypes = [IMAGE, c_float, c_float, c_int, c_int, c_int, POINTER(c_int)]
+harris_corner_detector_budget.restype = POINTER(DESCRIPTOR)
+
+fast_corner_detector = lib.fast_corner_detector
+fast_corner_detector.argtypes = [IMAGE, c_float, c_int, c_int, c_int, POINTER(c_int)]
+fast_corner_detector.restype = POINTER(DESCRIPTOR)
+
+harris_corner_detector_grid = lib.harris_corner_detector_grid
+harris_corner_detector_grid.argtypes = [IMAGE, c_float, c_float, c_int, c_int, c_int, c_int, POINTER(c_int)]
+harris_corner_detector_grid.restype = POINTER(DESCRIPTOR)
+
+harris_corner_detector_stream = lib.harris_corner_detector_stream
+harris_corner_detector_stream.argtypes = [IMAGE, c_float, c_float, c_int, POINTER(c_int)]
+harris_corner_detector_stream.restype = POINTER(DESCRIPTOR)
+
+match_descriptors_ratio = lib.match_descriptors_ratio
+match_descriptors_ratio.argtypes = [POINTER(DESCRIPTOR), c_int, POINTER(DESCRIPTOR), c_int, c_float, c_int, POINTER(c_int)]
+match_descriptors_ratio.restype = POINTER(MATCH)
+
 mark_corners = lib.mark_corners
 mark_corners.argtypes = [IMAGE, POINTER(DESCRIPTOR), c_int]
 mark_corners.restype = None
@@ -199,6 +240,10 @@ cylindrical_project = lib.cylindrical_project
 cylindrical_project.argtypes = [IMAGE, c_float]
 cylindrical_project.restype = IMAGE
 
+spherical_project = lib.spherical_project
+spherical_project.argtypes = [IMAGE, c_float]
+spherical_project.restype = IMAGE
+
 structure_matrix = lib.structure_matrix
 structure_matrix.argtypes = [IMAGE, c_float]
 structure_matrix.restype = IMAGE
@@ -207,6 +252,13 @@ find_and_draw_matches = lib.find_and_draw_matches
 find_and_draw_matches.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int]
 find_and_draw_matches.restype = IMAGE
 
+set_feature_cache_lib = lib.set_feature_cache
+set_feature_cache_lib.argtypes = [c_char_p]
+set_feature_cache_lib.restype = None
+
+def set_feature_cache(path):
+    set_feature_cache_lib(path.encode('ascii') if path else None)
+
 panorama_image_lib = lib.panorama_image
 panorama_image_lib.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int, c_float, c_int, c_int]
 panorama_image_lib.restype = IMAGE
@@ -227,9 +279,42 @@ optical_flow_webcam = lib.optical_flow_webcam
 optical_flow_webcam.argtypes = [c_int, c_int, c_int]
 optical_flow_webcam.restype = None
 
+optical_flow_pyramid = lib.optical_flow_pyramid
+optical_flow_pyramid.argtypes = [IMAGE, IMAGE, c_int, c_int, c_int, c_int]
+optical_flow_pyramid.restype = IMAGE
+
+optical_flow_webcam_pyramid = lib.optical_flow_webcam_pyramid
+optical_flow_webcam_pyramid.argtypes = [c_int, c_int, c_int]
+optical_flow_webcam_pyramid.restype = None
+
 def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30):
     return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff)
 
+panorama_images_lib = lib.panorama_images
+panorama_images_lib.argtypes = [POINTER(IMAGE), c_int, c_int, c_float, c_float, c_int, c_float, c_int, c_int]
+panorama_images_lib.restype = IMAGE
+
+def panorama_images(ims, ref=0, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30):
+    return panorama_images_lib(c_array(IMAGE, ims), len(ims), ref, sigma, thresh, nms, inlier_thresh, iters, cutoff)
+
+class PIPELINE_TIMES(Structure):
+    _fields_ = [("stage", c_double*5),
+                ("wall", c_double)]
+
+panorama_pipeline_lib = lib.panorama_pipeline
+panorama_pipeline_lib.argtypes = [POINTER(c_char_p), c_int, c_float, c_float, c_int, c_float, c_int, c_int, POINTER(PIPELINE_TIMES)]
+panorama_pipeline_lib.restype = IMAGE
+
+print_pipeline_times = lib.print_pipeline_times
+print_pipeline_times.argtypes = [PIPELINE_TIMES]
+print_pipeline_times.restype = None
+
+def panorama_pipeline(paths, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30, timing=False):
+    times = PIPELINE_TIMES()
+    pan = panorama_pipeline_lib(c_array(c_char_p, [p.encode('ascii') for p in paths]), len(paths), sigma, thresh, nms, inlier_thresh, iters, cutoff, byref(times))
+    if timing: print_pipeline_times(times)
+    return pan
+
 
 train_model = lib.train_model
 train_model.argtypes = [MODEL, DATA, c_int, c_int, c_double, c_double, c_double]